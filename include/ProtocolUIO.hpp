@@ -48,9 +48,28 @@
 
 #include <uhal/ClientInterface.hpp>
 #include <uhal/ValMem.hpp>
+#include <uhal/definitions.hpp>
 #include <uhal/log/exception.hpp>
 #include <uhal/SigBusGuard.hpp>
+#include <uhal/Node.hpp>
 #include <signal.h> //for handling of SIG_BUS signals
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include <ProtocolUIO_queue.hpp>
+#include <ProtocolUIO_bookkeeping.hpp>
 
 /*
   The kernel patch would allow the device-tree property "linux,uio-name" to override the default label of uio devices.
@@ -61,17 +80,253 @@
 namespace uioaxi {
 
 
+  //Owns the fd of a /dev/uioN device, shared by all of its maps
+  struct sUIOFile{
+    explicit sUIOFile(int _fd);
+    ~sUIOFile();
+    int fd;
+    dev_t rdev; //device node this fd was opened on
+    ino_t ino;
+  private:
+    sUIOFile(sUIOFile const &) = delete;
+    sUIOFile & operator=(sUIOFile const &) = delete;
+  };
+
+  //Link health of one endpoint, shared by all of its maps
+  struct sEndpointHealth{
+    explicit sEndpointHealth(std::string const & aName);
+    std::string name;
+    std::atomic<bool> down;       //accesses fail fast while set
+    std::atomic<uint32_t> faults; //consecutive bus errors
+    bool     hasStatus;           //a link_status register was declared
+    uint32_t statusAddr;
+    uint32_t statusMask;          //the link is up when all these bits are set
+    bool     hasProbe;            //a probe register was declared
+    uint32_t probeAddr;           //safe to read: the link is up when it answers
+  private:
+    sEndpointHealth(sEndpointHealth const &) = delete;
+    sEndpointHealth & operator=(sEndpointHealth const &) = delete;
+  };
+
+  //One mapped region (mapN) of a UIO device
   struct sUIODevice{
     sUIODevice();
     ~sUIODevice();
-    int fd;
-    uint32_t volatile * hw;
+    std::shared_ptr<sUIOFile> file;
+    uint32_t volatile * hw; //first register, offset bytes into the mapping
     uint64_t addr;
     uint32_t uhalAddr;
     size_t   size;
+    size_t   offset;
+    size_t   mapBytes;      //length of the mapping
+    uint32_t mapIndex;
+    bool     rmwReadback; //read RMW results back from the register
+    uint32_t busDomain;   //maps in different domains can be accessed in parallel
+    std::shared_ptr<sEndpointHealth> health;
     std::string uioName;
     std::string hwNodeName;
+  private:
+    sUIODevice(sUIODevice const &) = delete;
+    sUIODevice & operator=(sUIODevice const &) = delete;
+  };
+
+  enum eTransactionType {
+    UIO_WRITE,
+    UIO_WRITE_BLOCK,
+    UIO_READ,
+    UIO_READ_BLOCK,
+    UIO_RMW_BITS,
+    UIO_RMW_SUM
+  };
+
+  //One access queued for later execution (async dispatch)
+  struct sTransaction{
+    eTransactionType type;
+    uint32_t addr;
+    uint32_t value;  //write value, AND term or addend
+    uint32_t orTerm;
+    uint32_t size;   //block size
+    uhal::defs::BlockReadWriteMode mode;
+    size_t index;    //into the batch's words, blocks or payload
+  };
+
+  //A group of transactions submitted by one dispatch.  Batches are reused,
+  //so after the first few dispatches their storage no longer grows.
+  struct sBatch{
+    //drop the transactions but keep the storage
+    void clear();
+    std::vector<sTransaction> transactions;
+    std::vector<uhal::ValWord<uint32_t> > words;
+    std::vector<uhal::ValVector<uint32_t> > blocks;
+    std::vector<uint32_t> payload; //block write data
+    std::promise<void> done;
+    //scratch for executing the batch
+    std::vector<size_t> order;
+    std::vector<std::vector<size_t> > partitions;
+    std::vector<size_t> partitionOfDomain;
+  };
+
+  //Counters for the client's own per-dispatch bookkeeping (the ValWord and
+  //ValVector objects themselves are allocated by uHAL and not counted)
+  struct sBookkeepingStats{
+    uint64_t operations;  //transactions handled
+    uint64_t allocations; //times bookkeeping storage had to be allocated or grown
+  };
+
+  //A contiguous run of registers within one map
+  struct sSnapshotRange{
+    uint32_t uhalAddr;
+    uint32_t size;
+    size_t   offset; //into sSnapshot::data
+  };
+
+  //Precompiled list of registers copied by UIO::takeSnapshot
+  struct sSnapshotPlan{
+    std::vector<sSnapshotRange> ranges;
+    std::vector<uint32_t> addresses; //uhal address of each word
+    std::vector<std::string> paths;  //node path of each word
   };
+
+  //Register values captured in one pass
+  struct sSnapshot{
+    sSnapshot() : sequence(0) {}
+    std::shared_ptr<sSnapshotPlan const> plan;
+    std::vector<uint32_t> data;
+    uint64_t sequence;
+  };
+
+  //A word that differs between two snapshots of the same plan
+  struct sSnapshotChange{
+    uint32_t uhalAddr;
+    uint32_t oldValue;
+    uint32_t newValue;
+    std::string const * path; //points into the plan
+  };
+
+  //A group of registers sampled periodically by the UIO sampler
+  struct sSampleSet{
+    std::shared_ptr<sSnapshotPlan const> plan;
+    uint64_t periodNs;
+    uint64_t nextNs;  //next deadline on CLOCK_MONOTONIC
+    std::shared_ptr<SampleRing> ring;
+    //optional, called from the sampler thread with each sample
+    typedef std::function<void(uint64_t aTimeNs, uint32_t const * aData, size_t aSize, bool aValid)> Callback;
+    Callback callback;
+  };
+
+  //Cached read plan for one combination of due sample sets
+  struct sSamplePass{
+    std::shared_ptr<sSnapshotPlan const> plan; //union of the sets' registers
+    std::vector<std::vector<size_t> > setWords; //per set: index of each word in plan
+    std::vector<uint32_t> data;
+    std::vector<char> valid;
+  };
+
+  //Start of a shared memory segment published by UIO::publishRegisters.
+  //It is followed by uint32_t addresses[count] and uint32_t values[count];
+  //seq is odd while the publisher is writing.
+  struct sShmHeader{
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> generation; //bumped whenever the layout is rewritten
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> timeNs;     //CLOCK_MONOTONIC of the last sample
+    std::atomic<uint32_t> valid;
+  };
+
+  //A mapped publication segment, either written or read by this process
+  struct sShmSegment{
+    sShmSegment();
+    ~sShmSegment();
+    std::string name;
+    void * map;
+    size_t mapSize;
+    sShmHeader * header;
+    std::atomic<uint32_t> * values;
+    std::vector<uint32_t> addresses; //reader: copy taken at attach
+    uint64_t generation;             //reader: layout seen at attach
+    uint64_t maxAgeNs;               //reader: older values go to the bus
+  private:
+    sShmSegment(sShmSegment const &) = delete;
+    sShmSegment & operator=(sShmSegment const &) = delete;
+  };
+
+  //One entry of a configuration file: the bits set in mask take value's bits
+  struct sConfigWrite{
+    uint32_t addr;
+    uint32_t value;
+    uint32_t mask;
+  };
+
+  //A masked register update (possibly several folded together), or a run of
+  //plain writes to consecutive registers (values start at index)
+  struct sConfigOp{
+    uint32_t addr;
+    uint32_t count;
+    uint32_t andTerm; //0 for plain writes
+    uint32_t orTerm;
+    size_t   index;
+  };
+
+  //Outcome of UIO::loadConfiguration
+  struct sConfigReport{
+    sConfigReport();
+    size_t   writes;          //entries in the file
+    size_t   registers;       //distinct registers written
+    size_t   blockWrites;     //runs of consecutive plain writes
+    size_t   rmws;            //masked updates, one read and one write each
+    size_t   folded;          //masked writes folded into the update before them
+    double   seconds;         //time spent applying
+    double   writesPerSecond;
+    bool     failed;
+    uint32_t failedAddress;   //first register that faulted
+  };
+
+  //A map as described by /sys/class/uio/uioN/maps/mapM
+  struct sUIOMapInfo{
+    uint64_t addr;     //physical address of the first register (addr + offset)
+    size_t   offset;   //bytes from the start of the mapping to the first register
+    size_t   size;     //registers (uint32) from the first register to the end
+    size_t   mapBytes; //length of the mapping
+  };
+
+  //In ProtocolUIO_io.cpp
+  //Read a hex value from a sysfs file (e.g. /sys/class/uio/uio0/maps/map0/addr)
+  bool readSysfsHex(std::string const & path, uint64_t & value);
+  //False once aMap is past the last map of the device
+  bool readUIOMap(std::string const & aUIOName, size_t aMap, sUIOMapInfo & aInfo);
+
+  //In ProtocolUIO_sigbus.cpp
+  //SIGBUS protection with per-thread state (used for parallel dispatch).
+  //Throws uhal::exception::SigBusError just like uhal::SigBusGuard.
+  class ThreadBusGuard{
+  public:
+    static void protect(std::function<void()> const & aAccess, char const * aMessage);
+  };
+
+  //In ProtocolUIO_reload.cpp
+  //Shared hold on the device mappings for the length of an access, so a hot
+  //reload cannot unmap them underneath it.  A NULL lock makes it a no-op.
+  class DeviceFence{
+  public:
+    explicit DeviceFence(pthread_rwlock_t * aLock);
+    ~DeviceFence();
+  private:
+    pthread_rwlock_t * lock;
+    DeviceFence(DeviceFence const &) = delete;
+    DeviceFence & operator=(DeviceFence const &) = delete;
+  };
+
+  //In ProtocolUIO_snapshot.cpp
+  //Appends the words that differ between aPrevious and aCurrent to aChanges
+  void diffSnapshot(sSnapshot const & aPrevious, sSnapshot const & aCurrent,
+		    std::vector<sSnapshotChange> & aChanges);
+
+  //Selects the UIO constructor that skips the address table and discovery
+  struct sNoDiscovery{};
+  //Builds clients over test memory instead of UIO devices (test/UIOTestHook.hpp)
+  class UIOTestHook;
 }
 
 namespace uhal {
@@ -82,6 +337,11 @@ namespace uhal {
     UHAL_DEFINE_EXCEPTION_CLASS ( BadUIODevice , "Exception class to handle the case where uio device cannot be opened." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UnimplementedFunction , "Exception class to handle the case where an unimplemented function is called." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UIODevOOR , "Exception class for when a transaction would be out of mapped range." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( SnapshotMismatch , "Exception class for comparing snapshots taken with different plans." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( BadSampleSet , "Exception class for an invalid sample set or sampler failure." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( BadShmSegment , "Exception class for when a shared memory publication cannot be created or attached." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( EndpointDown , "Exception class for when an endpoint is marked down after repeated bus errors or a failed link check." )
+    UHAL_DEFINE_EXCEPTION_CLASS ( BadConfiguration , "Exception class for when a configuration file cannot be read or parsed." )
     UHAL_DEFINE_EXCEPTION_CLASS ( UIOMISSING , "No UIO endpoints found. Endpoints must be labeled with fwinfo=\"uio_endpoint\".  Are you using an old style address table?" )
   }
 
@@ -96,9 +356,70 @@ namespace uhal {
 	 );
     virtual ~UIO ();
 
+    //In ProtocolUIO_async.cpp
+    //Only meaningful with UIOUHAL_ASYNC_DISPATCH set.
+    //Future for the most recently dispatched batch; it holds the exception if the batch failed.
+    std::shared_future<void> getDispatchFuture();
+    //Called from the worker thread after each batch (null exception_ptr on success)
+    void setDispatchCallback(std::function<void(std::exception_ptr)> aCallback);
+    uioaxi::sBookkeepingStats getBookkeepingStats();
+
+    //Access one register right away, without uHAL's ValWord/ValHeader (which
+    //allocate) and without a dispatch.  For real-time loops.
+    uint32_t readRegister(uint32_t aAddr);
+    void writeRegister(uint32_t aAddr, uint32_t aValue);
+
+    //In ProtocolUIO_snapshot.cpp
+    //Build a plan covering the readable registers under each node path
+    std::shared_ptr<uioaxi::sSnapshotPlan const> compileSnapshot(std::vector<std::string> const & aNodes);
+    //Build a plan from raw (uhal address, size) ranges
+    std::shared_ptr<uioaxi::sSnapshotPlan const> compileSnapshot(std::vector<std::pair<uint32_t,uint32_t> > const & aRanges);
+    //Copy every register of aSnapshot.plan into aSnapshot.data in one guarded pass
+    void takeSnapshot(uioaxi::sSnapshot & aSnapshot);
+
+    //In ProtocolUIO_sampler.cpp
+    //Sample the readable registers under aNodes every aPeriod into a ring of
+    //aDepth samples, shared by all subscribers.  Returns the set's id.
+    size_t addSampleSet(std::vector<std::string> const & aNodes,
+			std::chrono::nanoseconds aPeriod, size_t aDepth = 64);
+    std::shared_ptr<uioaxi::SampleRing const> getSampleRing(size_t aSet);
+    std::shared_ptr<uioaxi::sSnapshotPlan const> getSamplePlan(size_t aSet);
+    void startSampling();
+    void stopSampling();
+
+    //In ProtocolUIO_shm.cpp
+    //Sample aNodes every aPeriod (once sampling is started) and publish them
+    //in the shared memory segment /dev/shm/aName for other processes
+    size_t publishRegisters(std::string const & aName, std::vector<std::string> const & aNodes,
+			    std::chrono::nanoseconds aPeriod);
+    //Serve reads of registers published in aName from shared memory as long
+    //as the published values are newer than aMaxAge
+    void attachPublication(std::string const & aName, std::chrono::nanoseconds aMaxAge);
+
+    //Rediscover every endpoint and remap the ones whose UIO device changed
+    //(e.g. after loading new firmware).  Returns the number remapped.
+    size_t reloadEndpoints();
+
+    //Apply the register writes of a configuration file (text lines of
+    //"address value [mask]" or the binary format, see README) directly,
+    //bypassing the dispatch queue.  Throws if the file cannot be parsed or
+    //an address is not mapped; a bus error stops the load and is reported.
+    uioaxi::sConfigReport loadConfiguration(std::string const & aFile);
+
+    //False while accesses to the endpoint fail fast (see README)
+    bool endpointUp(std::string const & aNodeId);
+    //Let accesses to a down endpoint reach the bus again (see README)
+    void resetEndpoint(std::string const & aNodeId);
+
 
   private:
 
+    friend class uioaxi::UIOTestHook;
+    //No endpoints and nothing started, the public constructor builds on it
+    UIO (const std::string& aId, const URI& aUri,
+	 const boost::posix_time::time_duration&aTimeoutPeriod,
+	 uioaxi::sNoDiscovery);
+
     // In ProtocolUIO_reg_access
     ValHeader implementWrite (const uint32_t& aAddr, const uint32_t& aValue);
     ValWord<uint32_t> implementRead (const uint32_t& aAddr,
@@ -128,18 +449,200 @@ namespace uhal {
 
   private:
 
-    //UHAL to UIO mappings
+    //UHAL to UIO mappings, one entry per map of each UIO device
     std::map<uint32_t,uioaxi::sUIODevice> devices;
 
+    //The address table this client was built from
+    std::unique_ptr<Node> addressTable;
+
     //=======================================================
     //In ProtocolUIO_io.cpp
     //=======================================================
     void openDevice  (uioaxi::sUIODevice & dev);
     int  checkDevice (uioaxi::sUIODevice & dev);    
-    int  symlinkFindUIO(std::string nodeId, uint32_t nodeAddress);
-    void dtFindUIO     (std::string nodeId, uint32_t nodeAddress);
+    std::string findUIO(std::string const & nodeId);
+    int  symlinkFindUIO(std::string nodeId, std::string & foundName);
+    std::string dtFindUIO(std::string nodeId);
+    void addDevice     (std::string const & nodeId, uint32_t nodeAddress,
+			std::string const & uioName);
+    void configureEndpoint (std::string const & nodeId, Node const & node);
+    std::shared_ptr<uioaxi::sUIOFile> openFile (std::string const & uioName);
+
+    //Real-time mode (UIOUHAL_REALTIME): populated, locked mappings and
+    //preallocated bookkeeping
+    bool realtime;
+    ValHeader realtimeHeader;
+    void setupRealtime ();
+    void lockDevices ();
     uint64_t SearchDeviceTree(std::string const & dvtPath,
 			      std::string const & name);
+
+    //=======================================================
+    //In ProtocolUIO_reg_access.cpp
+    //=======================================================
+    uioaxi::sUIODevice const & lookupDevice (uint32_t aAddr, uint32_t aCount = 1);
+    void     writeWord  (uint32_t aAddr, uint32_t aValue);
+    uint32_t readWord   (uint32_t aAddr);
+    void     writeBlock (uint32_t aAddr, uint32_t const * aValues, uint32_t aSize, defs::BlockReadWriteMode aMode);
+    void     readBlock  (uint32_t aAddr, uint32_t * aValues, uint32_t aSize, defs::BlockReadWriteMode aMode);
+    uint32_t rmwBits    (uint32_t aAddr, uint32_t aANDterm, uint32_t aORterm);
+    uint32_t rmwSum     (uint32_t aAddr, int32_t aAddend);
+    void     rmwFused   (uint32_t aAddr, uioaxi::sBatch & aBatch, std::vector<size_t> const & aIndices);
+    void     executeRMWRun (uioaxi::sBatch & aBatch, std::vector<size_t> const & aIndices,
+			    size_t aBegin, size_t aEnd);
+    //RMWs are held back until the next dispatch or non-RMW access so that
+    //updates of the same register can be fused (synchronous mode)
+    uioaxi::sBatch rmwBatch;
+    //A failed held back RMW is reported by the next dispatch, not by the
+    //access that happened to flush it; its ValWord stays invalid
+    std::exception_ptr rmwError;
+    //readRegister() etc. flush from any thread while the uHAL thread holds
+    //back more: rmwMutex guards rmwBatch and rmwError, rmwHeld lets the
+    //common case (nothing held) skip the lock
+    std::mutex rmwMutex;
+    std::atomic<bool> rmwHeld;
+    void flushRMW ();
+
+    //=======================================================
+    //In ProtocolUIO_snapshot.cpp
+    //=======================================================
+    //uhal address -> node path, filled on first use
+    std::map<uint32_t,std::string> addressPaths;
+    std::string const & pathOfAddress (uint32_t aAddr);
+    std::shared_ptr<uioaxi::sSnapshotPlan const> buildSnapshotPlan (std::vector<uint32_t> & aAddresses,
+								    bool aWithPaths = true);
+    void copyRanges (uioaxi::sSnapshotPlan const & aPlan, size_t aBegin, size_t aEnd, uint32_t * aData);
+
+    //=======================================================
+    //In ProtocolUIO_sampler.cpp
+    //=======================================================
+    std::vector<uioaxi::sSampleSet> sampleSets;
+    std::map<std::vector<size_t>,uioaxi::sSamplePass> samplePasses;
+    std::mutex samplerMutex;
+    std::thread samplerThread;
+    std::atomic<bool> samplerStop;
+    int samplerWakeFd;
+    void samplerLoop ();
+    void samplePass (std::vector<size_t> const & aDue, uint64_t aNowNs);
+
+    //=======================================================
+    //In ProtocolUIO_shm.cpp
+    //=======================================================
+    std::vector<std::unique_ptr<uioaxi::sShmSegment> > shmPublished;
+    //Attached segments are read from any thread that reads registers.  The
+    //list is never changed in place: attaching or re-mapping stores a new one
+    //(std::atomic_store), and a reader holding the old list keeps its
+    //segments mapped until it lets go.
+    typedef std::vector<std::shared_ptr<uioaxi::sShmSegment const> > ShmSegments;
+    std::shared_ptr<ShmSegments const> shmAttached;
+    std::atomic<bool> shmReading; //shmAttached is not empty
+    std::mutex shmMutex;          //serialises changes to the lists
+    std::unique_ptr<uioaxi::sShmSegment> mapPublication (std::string const & aName,
+							 std::chrono::nanoseconds aMaxAge);
+    std::shared_ptr<ShmSegments const> remapPublication (std::shared_ptr<uioaxi::sShmSegment const> const & aStale);
+    bool readPublished (uint32_t aAddr, uint32_t & aValue);
+
+    //=======================================================
+    //In ProtocolUIO_async.cpp
+    //=======================================================
+    bool asyncDispatch;
+    std::unique_ptr<uioaxi::sBatch> pendingBatch;
+    std::unique_ptr<uioaxi::SPSCRing<uioaxi::sBatch*> > asyncQueue;
+    std::unique_ptr<uioaxi::RecyclePool<uioaxi::sBatch> > asyncFree; //finished batches, for reuse
+    std::mutex asyncMutex;
+    std::condition_variable asyncCond;
+    bool asyncStop;
+    std::thread asyncThread;
+    std::shared_future<void> lastDispatch;
+    std::function<void(std::exception_ptr)> dispatchCallback;
+
+    void startAsyncDispatch (size_t aQueueDepth);
+    void stopAsyncDispatch ();
+    uioaxi::sTransaction & queueTransaction (uioaxi::sBatch & aBatch, uioaxi::eTransactionType aType, uint32_t aAddr);
+    void submitBatch ();
+    std::atomic<uint64_t> statOperations;
+    std::atomic<uint64_t> statAllocations;
+    void asyncWorker ();
+    void executeBatch (uioaxi::sBatch & aBatch);
+    void executeTransactions (uioaxi::sBatch & aBatch, std::vector<size_t> const & aIndices);
+    void executeTransaction (uioaxi::sBatch & aBatch, uioaxi::sTransaction & aTransaction);
+
+    //=======================================================
+    //In ProtocolUIO_parallel.cpp
+    //=======================================================
+    //Transactions are queued until dispatch (async or parallel dispatch)
+    bool deferDispatch;
+    //Use uioaxi::ThreadBusGuard instead of uhal::SigBusGuard
+    bool threadGuard;
+    std::map<std::string,uint32_t> busDomains;
+    std::vector<std::thread> poolThreads;
+    std::mutex poolMutex;
+    std::condition_variable poolCond;
+    std::condition_variable poolDoneCond;
+    bool poolStop;
+    uint64_t poolGeneration;
+    uioaxi::sBatch * poolBatch;
+    std::vector<std::vector<size_t> > * poolPartitions;
+    size_t poolCount; //partitions in use, the vector may hold more
+    size_t poolNext;
+    size_t poolRemaining;
+    std::vector<std::exception_ptr> poolErrors;
+    uint32_t busDomainIndex (std::string const & aDomain);
+    void startDispatchPool (size_t aThreads, std::vector<int> const & aCPUs);
+    void stopDispatchPool ();
+    void poolWorker ();
+    bool runNextPartition (uint64_t aGeneration);
+    void runPartitions (uioaxi::sBatch & aBatch, std::vector<std::vector<size_t> > & aPartitions,
+			size_t aCount);
+
+    //=======================================================
+    //In ProtocolUIO_config.cpp
+    //=======================================================
+    void applyConfiguration (std::vector<uioaxi::sConfigOp> const & aOps,
+			     std::vector<uint32_t> const & aValues,
+			     uioaxi::sConfigReport & aReport);
+
+    //=======================================================
+    //In ProtocolUIO_health.cpp
+    //=======================================================
+    //Consecutive bus errors that mark an endpoint down (0: never)
+    uint32_t faultThreshold;
+    std::chrono::milliseconds probePeriod;
+    std::vector<std::shared_ptr<uioaxi::sEndpointHealth> > endpointHealth;
+    std::mutex healthMutex;
+    std::condition_variable healthCond;
+    bool healthActive; //the monitor may run, set once construction succeeded
+    bool healthStop;   //shutting down, the monitor must not be restarted
+    std::thread healthThread;
+    //Guarded access that fails fast on a down endpoint and counts bus errors
+    void protectAccess (uioaxi::sUIODevice const & aDev, std::function<void()> const & aAccess,
+			char const * aMessage);
+    void busGuard (std::function<void()> const & aAccess, char const * aMessage);
+    std::shared_ptr<uioaxi::sEndpointHealth> configureHealth (std::string const & aNodeId,
+							      Node const & aNode);
+    void recordFault (uioaxi::sEndpointHealth & aHealth);
+    bool linkStatusUp (uioaxi::sEndpointHealth const & aHealth);
+    bool probeEndpoint (uioaxi::sEndpointHealth const & aHealth);
+    void startHealthMonitor ();
+    void stopHealthMonitor ();
+    void healthLoop ();
+
+    //=======================================================
+    //In ProtocolUIO_reload.cpp
+    //=======================================================
+    //Endpoint nodes of the address table, for rediscovery
+    std::vector<std::pair<std::string,Node const *> > endpoints;
+    //Accesses hold it shared, a reload exclusively (UIOUHAL_HOT_RELOAD)
+    bool hotReload;
+    pthread_rwlock_t devicesLock;
+    std::thread reloadThread;
+    int reloadWakeFd;
+    pthread_rwlock_t * fenceLock () {return hotReload ? &devicesLock : NULL;}
+    bool endpointChanged (std::string const & aNodeId, std::string const & aUIOName);
+    void removeEndpoint (std::string const & aNodeId);
+    void startHotReload ();
+    void stopHotReload ();
+    void reloadLoop ();
   };
 
 }
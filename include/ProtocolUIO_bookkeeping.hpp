@@ -0,0 +1,110 @@
+/*
+  ---------------------------------------------------------------------------
+
+  This is an extension of uHAL to directly access AXI slaves via the linux
+  UIO driver. 
+
+  This file is part of uHAL.
+
+  uHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  uHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+*/
+/**
+   @file
+   Reused storage for per-dispatch bookkeeping, with a count of how often it
+   still had to be allocated
+*/
+
+#ifndef __PROTOCOL_UIO_BOOKKEEPING_HH__
+#define __PROTOCOL_UIO_BOOKKEEPING_HH__
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ProtocolUIO_queue.hpp>
+
+namespace uioaxi {
+
+  //push_back, counting in aAllocations when the vector has to grow
+  template<typename T>
+  void countedPush(std::vector<T> & aVector, T const & aValue, std::atomic<uint64_t> & aAllocations){
+    if (aVector.size() == aVector.capacity()) {
+      aAllocations++;
+    }
+    aVector.push_back(aValue);
+  }
+
+  //resize, counting in aAllocations when the vector has to grow
+  template<typename T>
+  void countedResize(std::vector<T> & aVector, size_t aSize, std::atomic<uint64_t> & aAllocations){
+    if (aVector.capacity() < aSize) {
+      aAllocations++;
+    }
+    aVector.resize(aSize);
+  }
+
+  //assign, counting in aAllocations when the vector has to grow
+  template<typename T>
+  void countedAssign(std::vector<T> & aVector, size_t aSize, T const & aValue,
+		     std::atomic<uint64_t> & aAllocations){
+    if (aVector.capacity() < aSize) {
+      aAllocations++;
+    }
+    aVector.assign(aSize, aValue);
+  }
+
+  //Hands finished objects from one thread (give) back to another (take) for
+  //reuse.  Only allocates when none is free; owns the ones it holds.
+  template<typename T>
+  class RecyclePool{
+  public:
+    RecyclePool(size_t aDepth, std::atomic<uint64_t> & aAllocations) :
+      ring(aDepth), allocations(aAllocations){
+    }
+
+    ~RecyclePool(){
+      T * object;
+      while (ring.pop(object)) {
+	delete object;
+      }
+    }
+
+    T * take(){
+      T * object = NULL;
+      if (!ring.pop(object)) {
+	object = new T;
+	allocations++;
+      }
+      return object;
+    }
+
+    void give(T * aObject){
+      if (!ring.push(aObject)) {
+	delete aObject;
+      }
+    }
+
+  private:
+    SPSCRing<T*> ring;
+    std::atomic<uint64_t> & allocations;
+    RecyclePool(RecyclePool const &) = delete;
+    RecyclePool & operator=(RecyclePool const &) = delete;
+  };
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+  ---------------------------------------------------------------------------
+
+  This is an extension of uHAL to directly access AXI slaves via the linux
+  UIO driver. 
+
+  This file is part of uHAL.
+
+  uHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  uHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+*/
+/**
+   @file
+   Lock-free rings used to hand work and data between threads
+*/
+
+#ifndef __PROTOCOL_UIO_QUEUE_HH__
+#define __PROTOCOL_UIO_QUEUE_HH__
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace uioaxi {
+
+  //Lock-free as long as there is exactly one thread pushing and one popping.
+  //push() fails when the ring is full so the caller can apply backpressure.
+  template<typename T>
+  class SPSCRing{
+  public:
+    explicit SPSCRing(size_t aDepth) :
+      slots(aDepth+1), head(0), tail(0){
+    }
+
+    bool push(T const & aValue){
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t n = next(t);
+      if (n == head.load(std::memory_order_acquire)) {
+	return false;
+      }
+      slots[t] = aValue;
+      tail.store(n, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(T & aValue){
+      size_t h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire)) {
+	return false;
+      }
+      aValue = slots[h];
+      head.store(next(h), std::memory_order_release);
+      return true;
+    }
+
+    bool empty() const {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    bool full() const {
+      return next(tail.load(std::memory_order_acquire)) == head.load(std::memory_order_acquire);
+    }
+
+  private:
+    size_t next(size_t aIndex) const {
+      return (aIndex+1 == slots.size()) ? 0 : aIndex+1;
+    }
+
+    std::vector<T> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+  };
+
+  //Broadcast ring of fixed width samples.  One thread writes, any number of
+  //threads read without consuming; each slot is protected by a seqlock so a
+  //reader never sees a half written sample.
+  class SampleRing{
+  public:
+    SampleRing(size_t aWidth, size_t aDepth) :
+      slotCount(aDepth ? aDepth : 1),
+      slotWidth(aWidth),
+      slots(new sSlot[slotCount]),
+      data(new std::atomic<uint32_t>[slotCount*(aWidth ? aWidth : 1)]),
+      newest(0){
+      for (size_t i = 0; i < slotCount; i++) {
+	slots[i].seq.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    size_t width() const {return slotWidth;}
+    size_t depth() const {return slotCount;}
+
+    //Number of the newest complete sample, 0 before the first one
+    uint64_t latest() const {
+      return newest.load(std::memory_order_acquire);
+    }
+
+    void write(uint64_t aTimeNs, uint32_t const * aData, bool aValid){
+      uint64_t number = newest.load(std::memory_order_relaxed) + 1;
+      sSlot & slot = slots[(number-1) % slotCount];
+      //odd while the slot is being written
+      slot.seq.store(2*number-1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot.time.store(aTimeNs, std::memory_order_relaxed);
+      slot.valid.store(aValid, std::memory_order_relaxed);
+      std::atomic<uint32_t> * dst = &data[((number-1) % slotCount)*slotWidth];
+      for (size_t i = 0; i < slotWidth; i++) {
+	dst[i].store(aData[i], std::memory_order_relaxed);
+      }
+      slot.seq.store(2*number, std::memory_order_release);
+      newest.store(number, std::memory_order_release);
+    }
+
+    //Copy sample aNumber into aData (width() words).  Returns false if that
+    //sample has not been written yet or has already been overwritten.
+    bool read(uint64_t aNumber, uint32_t * aData, uint64_t & aTimeNs, bool & aValid) const {
+      if (aNumber == 0) {
+	return false;
+      }
+      sSlot const & slot = slots[(aNumber-1) % slotCount];
+      uint64_t before = slot.seq.load(std::memory_order_acquire);
+      if (before != 2*aNumber) {
+	return false;
+      }
+      aTimeNs = slot.time.load(std::memory_order_relaxed);
+      aValid  = slot.valid.load(std::memory_order_relaxed);
+      std::atomic<uint32_t> const * src = &data[((aNumber-1) % slotCount)*slotWidth];
+      for (size_t i = 0; i < slotWidth; i++) {
+	aData[i] = src[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return slot.seq.load(std::memory_order_relaxed) == before;
+    }
+
+  private:
+    struct sSlot{
+      std::atomic<uint64_t> seq;
+      std::atomic<uint64_t> time;
+      std::atomic<bool> valid;
+    };
+    size_t slotCount;
+    size_t slotWidth;
+    std::unique_ptr<sSlot[]> slots;
+    std::unique_ptr<std::atomic<uint32_t>[]> data;
+    std::atomic<uint64_t> newest;
+  };
+}
+#endif
@@ -49,6 +49,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sstream>
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
 #include <uhal/Node.hpp>
@@ -75,15 +76,74 @@ UHAL_REGISTER_EXTERNAL_CLIENT(uhal::UIO, "uioaxi-1.0", "Direct access to AXI sla
 namespace uhal {  
 
 
+  UIO::UIO (
+	    const std::string& aId, const URI& aUri,
+	    const boost::posix_time::time_duration&aTimeoutPeriod,
+	    uioaxi::sNoDiscovery
+	    ) :
+    ClientInterface(aId,aUri,aTimeoutPeriod),
+    realtime(NULL != getenv("UIOUHAL_REALTIME")),
+    rmwHeld(false),
+    samplerStop(false),
+    samplerWakeFd(-1),
+    shmReading(false),
+    asyncDispatch(false),
+    asyncStop(false),
+    statOperations(0),
+    statAllocations(0),
+    deferDispatch(false),
+    threadGuard(false),
+    poolStop(false),
+    poolGeneration(0),
+    poolBatch(NULL),
+    poolPartitions(NULL),
+    poolCount(0),
+    poolNext(0),
+    poolRemaining(0),
+    faultThreshold(3),
+    probePeriod(1000),
+    healthActive(false),
+    healthStop(false),
+    hotReload(false),
+    reloadWakeFd(-1)
+  {
+    //readers may nest (e.g. a sample pass building its plan), so a waiting
+    //reload must not block new readers
+    pthread_rwlockattr_t lockAttr;
+    pthread_rwlockattr_init(&lockAttr);
+    pthread_rwlockattr_setkind_np(&lockAttr, PTHREAD_RWLOCK_PREFER_READER_NP);
+    pthread_rwlock_init(&devicesLock, &lockAttr);
+    pthread_rwlockattr_destroy(&lockAttr);
+
+    //Per-thread SIGBUS guard, so a stalled access (e.g. a link probe) does not
+    //hold up every other guarded access in the process
+    threadGuard = realtime || (NULL != getenv("UIOUHAL_THREAD_GUARD"));
+
+    //Endpoint health: bus errors in a row before an endpoint is marked down,
+    //and how often down endpoints are probed
+    char* UIOUHAL_FAULT_THRESHOLD = getenv("UIOUHAL_FAULT_THRESHOLD");
+    if (NULL != UIOUHAL_FAULT_THRESHOLD) {
+      faultThreshold = std::strtoul(UIOUHAL_FAULT_THRESHOLD, 0, 0);
+    }
+    char* UIOUHAL_PROBE_PERIOD_MS = getenv("UIOUHAL_PROBE_PERIOD_MS");
+    if (NULL != UIOUHAL_PROBE_PERIOD_MS) {
+      probePeriod = std::chrono::milliseconds(std::strtoul(UIOUHAL_PROBE_PERIOD_MS, 0, 0));
+    }
+  }
+
   UIO::UIO (
 	    const std::string& aId, const URI& aUri,
 	    const boost::posix_time::time_duration&aTimeoutPeriod
 	    ) :
-    ClientInterface(aId,aUri,aTimeoutPeriod)
+    UIO(aId, aUri, aTimeoutPeriod, sNoDiscovery())
   {
+    //The delegated constructor has completed, so if anything below throws
+    //~UIO runs and stops whichever threads were already started (the pool,
+    //the async worker, the reload thread); each stop* is a no-op otherwise.
     //Search through the device tree for fw_info tags
     NodeTreeBuilder & mynodetreebuilder = NodeTreeBuilder::getInstance();
-    Node* lNode = ( mynodetreebuilder.getNodeTree ( std::string("file://")+aUri.mHostname , boost::filesystem::current_path() / "." ) );
+    addressTable.reset( mynodetreebuilder.getNodeTree ( std::string("file://")+aUri.mHostname , boost::filesystem::current_path() / "." ) );
+    Node* lNode = addressTable.get();
 
     //Search through the address table for nodes with endpoint fw_info tags
     auto itNode = lNode->begin();
@@ -98,11 +158,10 @@ namespace uhal {
 	
 	std::string name = itNode->getPath().substr(4);
 	//This is an endpoint
-	//add it to the lookup table
-	// try the simple method using "linux,uio-name" patch, else use the complex method (iterating thru dirs)
-	if (!symlinkFindUIO(name,itNode->getAddress())) {
-	  dtFindUIO(name,itNode->getAddress());
-	}
+	//add it to the lookup table, saving the mapping of every map of the device
+	addDevice(name, itNode->getAddress(), findUIO(name));
+	configureEndpoint(name, *itNode);
+	endpoints.push_back(std::make_pair(name, &(*itNode)));
       }
     }
   
@@ -112,10 +171,129 @@ namespace uhal {
       throw e;
     }
 
+    //Run transactions of different bus domains in parallel
+    char* UIOUHAL_DISPATCH_THREADS = getenv("UIOUHAL_DISPATCH_THREADS");
+    if ((NULL != UIOUHAL_DISPATCH_THREADS) && (0 < std::strtoul(UIOUHAL_DISPATCH_THREADS, 0, 0))) {
+      std::vector<int> cpus;
+      char* UIOUHAL_DISPATCH_CPUS = getenv("UIOUHAL_DISPATCH_CPUS");
+      if (NULL != UIOUHAL_DISPATCH_CPUS) {
+	std::stringstream cpuList(UIOUHAL_DISPATCH_CPUS);
+	std::string cpu;
+	while (std::getline(cpuList, cpu, ',')) {
+	  cpus.push_back(std::strtol(cpu.c_str(), 0, 0));
+	}
+      }
+      startDispatchPool(std::strtoul(UIOUHAL_DISPATCH_THREADS, 0, 0), cpus);
+    }
+
+    //Run transactions on a background thread instead of the caller's
+    if (NULL != getenv("UIOUHAL_ASYNC_DISPATCH")) {
+      size_t queueDepth = 16;
+      char* UIOUHAL_ASYNC_QUEUE_DEPTH = getenv("UIOUHAL_ASYNC_QUEUE_DEPTH");
+      if (NULL != UIOUHAL_ASYNC_QUEUE_DEPTH) {
+	queueDepth = std::strtoul(UIOUHAL_ASYNC_QUEUE_DEPTH, 0, 0);
+      }
+      startAsyncDispatch(queueDepth);
+    }
+
+    //Serve published registers from shared memory
+    char* UIOUHAL_SHM_READ = getenv("UIOUHAL_SHM_READ");
+    if (NULL != UIOUHAL_SHM_READ) {
+      uint64_t maxAgeUs = 100000;
+      char* UIOUHAL_SHM_MAX_AGE_US = getenv("UIOUHAL_SHM_MAX_AGE_US");
+      if (NULL != UIOUHAL_SHM_MAX_AGE_US) {
+	maxAgeUs = std::strtoull(UIOUHAL_SHM_MAX_AGE_US, 0, 0);
+      }
+      std::stringstream names(UIOUHAL_SHM_READ);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+	try {
+	  attachPublication(name, std::chrono::microseconds(maxAgeUs));
+	} catch (uhal::exception::BadShmSegment & e) {
+	  //no publisher yet, every read goes to the bus
+	  log (Notice(), "UIO: not using shared memory publication ", name);
+	}
+      }
+    }
+
+    //Remap endpoints whose UIO device is replaced (firmware reload)
+    if (NULL != getenv("UIOUHAL_HOT_RELOAD")) {
+      startHotReload();
+    }
+
+    if (realtime) {
+      setupRealtime();
+    }
+
+    //Check declared link-status registers, only now that nothing can throw
+    bool linkStatus = false;
+    {
+      std::lock_guard<std::mutex> lock(healthMutex);
+      healthActive = true;
+      for (size_t iHealth = 0; iHealth < endpointHealth.size(); iHealth++) {
+	linkStatus = linkStatus || endpointHealth[iHealth]->hasStatus;
+      }
+    }
+    if (linkStatus) {
+      startHealthMonitor();
+    }
+  }
+
+  void UIO::configureEndpoint (std::string const & nodeId, Node const & node) {
+    auto const & fwinfo = node.getFirmwareInfo();
+
+    //RMW read-back: fwinfo="uio_endpoint;rmw_readback=always|never|debug"
+    bool rmwReadback = true;
+    auto itReadback = fwinfo.find("rmw_readback");
+    if (itReadback != fwinfo.end()) {
+      if (itReadback->second == "never") {
+	rmwReadback = false;
+      } else if (itReadback->second == "debug") {
+	rmwReadback = (NULL != getenv("UIOUHAL_DEBUG"));
+      } else if (itReadback->second != "always") {
+	log (Notice(), "UIO: unknown rmw_readback \"", itReadback->second, "\" for ", nodeId, ", using always");
+      }
+    }
+
+    std::shared_ptr<sEndpointHealth> health = configureHealth(nodeId, node);
+
+    //apply to every map of this endpoint
+    for (auto itDev = devices.begin(); itDev != devices.end(); itDev++) {
+      if (itDev->second.hwNodeName == nodeId) {
+	itDev->second.rmwReadback = rmwReadback;
+	itDev->second.health = health;
+	//Bus domain: fwinfo="uio_endpoint;bus_domain=C2C1", else one per uio device
+	auto itDomain = fwinfo.find("bus_domain");
+	itDev->second.busDomain = busDomainIndex((itDomain != fwinfo.end()) ?
+						 itDomain->second :
+						 "uio:" + itDev->second.uioName);
+      }
+    }
   }
 
   UIO::~UIO () {
     log ( Debug() , "UIO: destructor" );
+    //apply RMWs still held back, they were issued before the client went away
+    if (rmwHeld) {
+      DeviceFence fence(fenceLock());
+      flushRMW();
+    }
+    if (rmwError) {
+      //no other thread may use the client any more
+      log ( Error() , "UIO: a held back RMW failed and was never dispatched" );
+    }
+    {
+      //faults from the threads still running must not restart the monitor
+      std::lock_guard<std::mutex> lock(healthMutex);
+      healthStop = true;
+    }
+    healthCond.notify_all();
+    stopHotReload();
+    stopSampling();
+    stopAsyncDispatch();
+    stopDispatchPool();
+    stopHealthMonitor();
+    pthread_rwlock_destroy(&devicesLock);
   }
 
   
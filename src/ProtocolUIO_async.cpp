@@ -0,0 +1,290 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <exception>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+namespace uioaxi {
+
+  void sBatch::clear() {
+    transactions.clear();
+    words.clear();
+    blocks.clear();
+    payload.clear();
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  void UIO::startAsyncDispatch (size_t aQueueDepth) {
+    if (aQueueDepth == 0) {
+      aQueueDepth = 1;
+    }
+    asyncQueue.reset(new SPSCRing<sBatch*>(aQueueDepth));
+    //every batch is either pending, queued, running or free
+    asyncFree.reset(new RecyclePool<sBatch>(aQueueDepth+2, statAllocations));
+    if (!pendingBatch) {
+      pendingBatch.reset(new sBatch);
+    }
+    asyncStop = false;
+    asyncThread = std::thread(&UIO::asyncWorker, this);
+    asyncDispatch = true;
+    deferDispatch = true;
+    log ( Debug(), "UIO: async dispatch enabled, queue depth ", Integer(aQueueDepth));
+  }
+
+  void UIO::stopAsyncDispatch () {
+    if (!asyncThread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(asyncMutex);
+      asyncStop = true;
+    }
+    asyncCond.notify_all();
+    //the worker drains everything already submitted before exiting
+    asyncThread.join();
+    asyncDispatch = false;
+    asyncFree.reset();
+  }
+
+  std::shared_future<void> UIO::getDispatchFuture () {
+    //submitBatch replaces it from the dispatching thread
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    return lastDispatch;
+  }
+
+  sBookkeepingStats UIO::getBookkeepingStats () {
+    sBookkeepingStats stats;
+    stats.operations  = statOperations;
+    stats.allocations = statAllocations;
+    return stats;
+  }
+
+  void UIO::setDispatchCallback (std::function<void(std::exception_ptr)> aCallback) {
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    dispatchCallback = aCallback;
+  }
+
+  sTransaction & UIO::queueTransaction (sBatch & aBatch, eTransactionType aType, uint32_t aAddr) {
+    sTransaction trans;
+    trans.type   = aType;
+    trans.addr   = aAddr;
+    trans.value  = 0;
+    trans.orTerm = 0;
+    trans.size   = 1;
+    trans.mode   = defs::SINGLE;
+    trans.index  = 0;
+    statOperations++;
+    countedPush(aBatch.transactions, trans, statAllocations);
+    return aBatch.transactions.back();
+  }
+
+  void UIO::submitBatch () {
+    sBatch * batch = pendingBatch.release();
+    {
+      std::lock_guard<std::mutex> lock(asyncMutex);
+      lastDispatch = batch->done.get_future().share();
+    }
+    //reuse a finished batch if there is one
+    pendingBatch.reset(asyncFree->take());
+
+    //Backpressure: block the caller while the queue is full
+    while (!asyncQueue->push(batch)) {
+      std::unique_lock<std::mutex> lock(asyncMutex);
+      asyncCond.wait(lock, [this] {return !asyncQueue->full();});
+    }
+    {
+      std::lock_guard<std::mutex> lock(asyncMutex);
+    }
+    asyncCond.notify_all();
+  }
+
+  void UIO::asyncWorker () {
+    sBatch * batch = NULL;
+    while (true) {
+      if (!asyncQueue->pop(batch)) {
+	std::unique_lock<std::mutex> lock(asyncMutex);
+	if (asyncStop && asyncQueue->empty()) {
+	  break;
+	}
+	asyncCond.wait(lock, [this] {return asyncStop || !asyncQueue->empty();});
+	continue;
+      }
+      //a slot was freed, wake up a producer waiting on backpressure
+      {
+	std::lock_guard<std::mutex> lock(asyncMutex);
+      }
+      asyncCond.notify_all();
+
+      std::exception_ptr error;
+      try {
+	DeviceFence fence(fenceLock());
+	executeBatch(*batch);
+	batch->done.set_value();
+      } catch (...) {
+	error = std::current_exception();
+	batch->done.set_exception(error);
+      }
+      std::function<void(std::exception_ptr)> callback;
+      {
+	std::lock_guard<std::mutex> lock(asyncMutex);
+	callback = dispatchCallback;
+      }
+      if (callback) {
+	callback(error);
+      }
+      batch->clear();
+      batch->done = std::promise<void>();
+      asyncFree->give(batch);
+    }
+  }
+
+  void UIO::executeBatch (sBatch & aBatch) {
+    std::vector<sTransaction> const & transactions = aBatch.transactions;
+    if (poolThreads.empty()) {
+      countedResize(aBatch.order, transactions.size(), statAllocations);
+      for (size_t i = 0; i < aBatch.order.size(); i++) {
+	aBatch.order[i] = i;
+      }
+      executeTransactions(aBatch, aBatch.order);
+      return;
+    }
+
+    //split by bus domain, keeping the order within each domain
+    static size_t const noPartition = size_t(-1);
+    countedAssign(aBatch.partitionOfDomain, busDomains.size(), noPartition, statAllocations);
+    size_t nPartitions = 0;
+    for (size_t i = 0; i < transactions.size(); i++) {
+      uint32_t domain = lookupDevice(transactions[i].addr).busDomain;
+      size_t & partition = aBatch.partitionOfDomain[domain];
+      if (partition == noPartition) {
+	partition = nPartitions++;
+	if (aBatch.partitions.size() < nPartitions) {
+	  countedResize(aBatch.partitions, nPartitions, statAllocations);
+	}
+	aBatch.partitions[partition].clear();
+      }
+      countedPush(aBatch.partitions[partition], i, statAllocations);
+    }
+    if (nPartitions == 1) {
+      executeTransactions(aBatch, aBatch.partitions[0]);
+    } else if (nPartitions > 1) {
+      runPartitions(aBatch, aBatch.partitions, nPartitions);
+    }
+  }
+
+  void UIO::executeTransactions (sBatch & aBatch, std::vector<size_t> const & aIndices) {
+    std::vector<sTransaction> const & transactions = aBatch.transactions;
+    size_t i = 0;
+    while (i < aIndices.size()) {
+      eTransactionType type = transactions[aIndices[i]].type;
+      if ((type == UIO_RMW_BITS) || (type == UIO_RMW_SUM)) {
+	//a run of back to back RMWs, neighbours may be fused
+	size_t end = i + 1;
+	while ((end < aIndices.size()) &&
+	       ((transactions[aIndices[end]].type == UIO_RMW_BITS) ||
+		(transactions[aIndices[end]].type == UIO_RMW_SUM))) {
+	  end++;
+	}
+	executeRMWRun(aBatch, aIndices, i, end);
+	i = end;
+      } else {
+	executeTransaction(aBatch, aBatch.transactions[aIndices[i]]);
+	i++;
+      }
+    }
+  }
+
+  void UIO::executeTransaction (sBatch & aBatch, sTransaction & aTransaction) {
+    switch (aTransaction.type) {
+    case UIO_WRITE:
+      writeWord(aTransaction.addr, aTransaction.value);
+      break;
+    case UIO_WRITE_BLOCK:
+      writeBlock(aTransaction.addr, &aBatch.payload[aTransaction.index],
+		 aTransaction.size, aTransaction.mode);
+      break;
+    case UIO_READ:
+      {
+	ValWord<uint32_t> & word = aBatch.words[aTransaction.index];
+	word.value(readWord(aTransaction.addr));
+	word.valid(true);
+      }
+      break;
+    case UIO_READ_BLOCK:
+      {
+	static thread_local std::vector<uint32_t> read_vector;
+	countedResize(read_vector, aTransaction.size, statAllocations);
+	readBlock(aTransaction.addr, read_vector.data(), aTransaction.size, aTransaction.mode);
+	ValVector<uint32_t> & block = aBatch.blocks[aTransaction.index];
+	for (size_t i = 0; i < read_vector.size(); i++) {
+	  block.push_back(read_vector[i]);
+	}
+	block.valid(true);
+      }
+      break;
+    case UIO_RMW_BITS:
+    case UIO_RMW_SUM:
+      {
+	static thread_local std::vector<size_t> indices(1);
+	indices[0] = &aTransaction - aBatch.transactions.data();
+	rmwFused(aTransaction.addr, aBatch, indices);
+      }
+      break;
+    }
+  }
+
+}   // namespace uhal
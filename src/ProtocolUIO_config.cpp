@@ -0,0 +1,350 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+//Binary configuration: magic, version, then (address, value, mask) records,
+//all little endian uint32
+#define UIO_CONFIG_MAGIC   0x434F4955 // "UIOC"
+#define UIO_CONFIG_VERSION 1
+
+//Parse a decimal or 0x prefixed hex number that fits in 32 bits
+static bool parseNumber(char const * & aPtr, char const * aEnd, uint32_t & aValue){
+  uint64_t value = 0;
+  uint64_t base = 10;
+  if ((aEnd - aPtr > 2) && ('0' == aPtr[0]) && (('x' == aPtr[1]) || ('X' == aPtr[1]))) {
+    base = 16;
+    aPtr += 2;
+  }
+  char const * start = aPtr;
+  for (; aPtr < aEnd; aPtr++) {
+    uint64_t digit;
+    char c = *aPtr;
+    if ((c >= '0') && (c <= '9')) {
+      digit = c - '0';
+    } else if ((16 == base) && (c >= 'a') && (c <= 'f')) {
+      digit = c - 'a' + 10;
+    } else if ((16 == base) && (c >= 'A') && (c <= 'F')) {
+      digit = c - 'A' + 10;
+    } else {
+      break;
+    }
+    value = value*base + digit;
+    if (value > 0xFFFFFFFFULL) {
+      return false;
+    }
+  }
+  aValue = uint32_t(value);
+  return aPtr != start;
+}
+
+static bool isSeparator(char c){
+  return (' ' == c) || ('\t' == c) || ('\r' == c) || (',' == c);
+}
+
+namespace uioaxi {
+
+  sConfigReport::sConfigReport() :
+    writes(0),
+    registers(0),
+    blockWrites(0),
+    rmws(0),
+    folded(0),
+    seconds(0),
+    writesPerSecond(0),
+    failed(false),
+    failedAddress(0){
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  //"address value [mask]" per line, '#' starts a comment
+  static void parseText(std::string const & aFile, char const * aPtr, char const * aEnd,
+			std::vector<sConfigWrite> & aWrites) {
+    size_t line = 1;
+    while (aPtr < aEnd) {
+      uint32_t fields[3];
+      size_t nFields = 0;
+      bool bad = false;
+      while ((aPtr < aEnd) && ('\n' != *aPtr)) {
+	if (isSeparator(*aPtr)) {
+	  aPtr++;
+	} else if ('#' == *aPtr) {
+	  while ((aPtr < aEnd) && ('\n' != *aPtr)) {
+	    aPtr++;
+	  }
+	} else if ((nFields < 3) && parseNumber(aPtr, aEnd, fields[nFields])) {
+	  nFields++;
+	  bad = bad || ((aPtr < aEnd) && ('\n' != *aPtr) && ('#' != *aPtr) && !isSeparator(*aPtr));
+	} else {
+	  bad = true;
+	  aPtr++;
+	}
+      }
+      if (bad || (1 == nFields)) {
+	uhal::exception::BadConfiguration lExc;
+	log (lExc, "Configuration ", aFile, " line ", Integer(uint32_t(line)),
+	     ": expected \"address value [mask]\"");
+	throw lExc;
+      }
+      if (nFields >= 2) {
+	sConfigWrite write = {fields[0], fields[1], (3 == nFields) ? fields[2] : 0xFFFFFFFF};
+	aWrites.push_back(write);
+      }
+      aPtr++; //newline
+      line++;
+    }
+  }
+
+  static void parseBinary(std::string const & aFile, char const * aPtr, char const * aEnd,
+			  std::vector<sConfigWrite> & aWrites) {
+    uint32_t header[2];
+    size_t recordSize = 3*sizeof(uint32_t);
+    if ((size_t(aEnd - aPtr) < sizeof(header)) ||
+	(0 != (size_t(aEnd - aPtr) - sizeof(header)) % recordSize)) {
+      uhal::exception::BadConfiguration lExc;
+      log (lExc, "Configuration ", aFile, " is truncated");
+      throw lExc;
+    }
+    memcpy(header, aPtr, sizeof(header));
+    if (UIO_CONFIG_VERSION != header[1]) {
+      uhal::exception::BadConfiguration lExc;
+      log (lExc, "Configuration ", aFile, " has unknown version ", Integer(header[1]));
+      throw lExc;
+    }
+    aPtr += sizeof(header);
+    aWrites.resize((aEnd - aPtr)/recordSize);
+    for (size_t iWrite = 0; iWrite < aWrites.size(); iWrite++, aPtr += recordSize) {
+      uint32_t record[3];
+      memcpy(record, aPtr, recordSize);
+      aWrites[iWrite].addr  = record[0];
+      aWrites[iWrite].value = record[1];
+      aWrites[iWrite].mask  = record[2];
+    }
+  }
+
+  sConfigReport UIO::loadConfiguration (std::string const & aFile) {
+    sConfigReport report;
+
+    //read the file through a private mapping, parsing straight out of it
+    int fd = open(aFile.c_str(), O_RDONLY|O_CLOEXEC);
+    struct stat fileStat;
+    if ((-1 == fd) || (0 != fstat(fd, &fileStat))) {
+      uhal::exception::BadConfiguration lExc;
+      log (lExc, "Failed to open configuration ", aFile, ": ", strerror(errno));
+      if (-1 != fd) {
+	close(fd);
+      }
+      throw lExc;
+    }
+    size_t size = fileStat.st_size;
+    std::vector<sConfigWrite> writes;
+    if (0 < size) {
+      void * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (MAP_FAILED == map) {
+	uhal::exception::BadConfiguration lExc;
+	log (lExc, "Failed to map configuration ", aFile, ": ", strerror(errno));
+	throw lExc;
+      }
+      madvise(map, size, MADV_SEQUENTIAL);
+      char const * begin = (char const *) map;
+      uint32_t magic = 0;
+      memcpy(&magic, begin, std::min(size, sizeof(magic)));
+      try {
+	if (UIO_CONFIG_MAGIC == magic) {
+	  parseBinary(aFile, begin, begin + size, writes);
+	} else {
+	  parseText(aFile, begin, begin + size, writes);
+	}
+      } catch (...) {
+	munmap(map, size);
+	throw;
+      }
+      munmap(map, size);
+    } else {
+      close(fd);
+    }
+    report.writes = writes.size();
+
+    //sort by address, keeping the file order of writes to the same register
+    std::stable_sort(writes.begin(), writes.end(),
+		     [] (sConfigWrite const & a, sConfigWrite const & b) {return a.addr < b.addr;});
+
+    DeviceFence fence(fenceLock());
+    //every plain write is kept, so strobes, resets and FIFO writes all reach
+    //the bus.  Consecutive masked writes to disjoint bits of a register fold
+    //into one update, and plain writes to consecutive registers of the same
+    //map merge into blocks.
+    std::vector<sConfigOp> ops;
+    std::vector<uint32_t> values;
+    sUIODevice const * lastDev = NULL;
+    size_t iWrite = 0;
+    while (iWrite < writes.size()) {
+      uint32_t addr = writes[iWrite].addr;
+      sUIODevice const * dev = NULL;
+      for (; (iWrite < writes.size()) && (writes[iWrite].addr == addr); iWrite++) {
+	uint32_t value = writes[iWrite].value;
+	uint32_t mask = writes[iWrite].mask;
+	if (0 == mask) {
+	  //nothing to change
+	  continue;
+	}
+	if (NULL == dev) {
+	  //throws for unmapped addresses before anything is written
+	  dev = &lookupDevice(addr);
+	  report.registers++;
+	}
+	if (0xFFFFFFFF == mask) {
+	  if (!ops.empty() && (0 == ops.back().andTerm) && (dev == lastDev) &&
+	      (ops.back().addr + ops.back().count == addr)) {
+	    ops.back().count++;
+	  } else {
+	    sConfigOp op = {addr, 1, 0, 0, values.size()};
+	    ops.push_back(op);
+	    report.blockWrites++;
+	  }
+	  values.push_back(value);
+	} else if (!ops.empty() && (0 != ops.back().andTerm) && (ops.back().addr == addr) &&
+		   (0 == (~ops.back().andTerm & mask)) && (0 != (ops.back().andTerm & ~mask))) {
+	  //bits the update does not touch yet, and some left untouched after
+	  ops.back().andTerm &= ~mask;
+	  ops.back().orTerm |= value & mask;
+	  report.folded++;
+	} else {
+	  sConfigOp op = {addr, 1, ~mask, value & mask, 0};
+	  ops.push_back(op);
+	  report.rmws++;
+	}
+	lastDev = dev;
+      }
+    }
+
+    //queued RMWs were issued before this call, so they go first
+    flushRMW();
+    auto start = std::chrono::steady_clock::now();
+    applyConfiguration(ops, values, report);
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (0 < report.seconds) {
+      report.writesPerSecond = report.writes / report.seconds;
+    }
+
+    uint32_t micros = uint32_t(report.seconds*1e6);
+    if (report.failed) {
+      log (Error(), "UIO: configuration ", aFile, " failed at ",
+	   Integer(report.failedAddress, IntFmt<hex,fixed>()), " after ", Integer(micros), " us");
+    } else {
+      log (Info(), "UIO: configuration ", aFile, ": ", Integer(uint32_t(report.writes)), " writes to ",
+	   Integer(uint32_t(report.registers)), " registers (", Integer(uint32_t(report.blockWrites)),
+	   " blocks, ", Integer(uint32_t(report.rmws)), " RMWs, ", Integer(uint32_t(report.folded)),
+	   " masked writes folded) in ", Integer(micros), " us");
+    }
+    return report;
+  }
+
+  void UIO::applyConfiguration (std::vector<sConfigOp> const & aOps,
+				std::vector<uint32_t> const & aValues,
+				sConfigReport & aReport) {
+    //one guarded batch per map
+    size_t iBegin = 0;
+    while (iBegin < aOps.size()) {
+      sUIODevice const & dev = lookupDevice(aOps[iBegin].addr);
+      size_t iEnd = iBegin + 1;
+      while ((iEnd < aOps.size()) && (&dev == &lookupDevice(aOps[iEnd].addr))) {
+	iEnd++;
+      }
+
+      //the register being written, still valid after a bus error unwinds
+      volatile uint32_t current = aOps[iBegin].addr;
+      char error_message[] = "Configuration: 0x00000000";
+      snprintf(error_message, strlen(error_message)+1, "Configuration: 0x%08X", aOps[iBegin].addr);
+      std::function<void()> apply = [&] {
+	for (size_t iOp = iBegin; iOp < iEnd; iOp++) {
+	  sConfigOp const & op = aOps[iOp];
+	  uint32_t volatile * reg = dev.hw + (op.addr - dev.uhalAddr);
+	  if (0 == op.andTerm) {
+	    uint32_t const * values = &aValues[op.index];
+	    for (uint32_t i = 0; i < op.count; i++) {
+	      current = op.addr + i;
+	      reg[i] = values[i];
+	    }
+	  } else {
+	    current = op.addr;
+	    *reg = (*reg & op.andTerm) | op.orTerm;
+	  }
+	}
+      };
+      try {
+	protectAccess(dev, apply, error_message);
+      } catch (uhal::exception::exception & e) {
+	aReport.failed = true;
+	aReport.failedAddress = current;
+	return;
+      }
+      iBegin = iEnd;
+    }
+  }
+
+}   // namespace uhal
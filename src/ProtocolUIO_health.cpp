@@ -0,0 +1,281 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+namespace uioaxi {
+
+  sEndpointHealth::sEndpointHealth(std::string const & aName) :
+    name(aName),
+    down(false),
+    faults(0),
+    hasStatus(false),
+    statusAddr(0),
+    statusMask(0),
+    hasProbe(false),
+    probeAddr(0){
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  void UIO::busGuard (std::function<void()> const & aAccess, char const * aMessage) {
+    if (threadGuard) {
+      ThreadBusGuard::protect(aAccess, aMessage);
+    } else {
+      uhal::SigBusGuard lGuard;
+      lGuard.protect(aAccess, aMessage);
+    }
+  }
+
+  void UIO::protectAccess (sUIODevice const & aDev, std::function<void()> const & aAccess,
+			   char const * aMessage) {
+    sEndpointHealth * health = aDev.health.get();
+    if ((NULL != health) && health->down.load(std::memory_order_relaxed)) {
+      //don't wait for another AXI timeout on a dead link
+      uhal::exception::EndpointDown lExc;
+      log (lExc, "Endpoint ", aDev.hwNodeName, " is down (", aMessage, ")");
+      throw lExc;
+    }
+    try {
+      busGuard(aAccess, aMessage);
+    } catch (uhal::exception::SigBusError & e) {
+      if (NULL != health) {
+	recordFault(*health);
+      }
+      throw;
+    }
+    if ((NULL != health) && (0 != health->faults.load(std::memory_order_relaxed))) {
+      health->faults.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  std::shared_ptr<sEndpointHealth> UIO::configureHealth (std::string const & aNodeId,
+							 Node const & aNode) {
+    std::shared_ptr<sEndpointHealth> health = std::make_shared<sEndpointHealth>(aNodeId);
+    //Link status: fwinfo="uio_endpoint;link_status=C2C1.STATUS.LINK_GOOD"
+    auto const & fwinfo = aNode.getFirmwareInfo();
+    auto itStatus = fwinfo.find("link_status");
+    if (itStatus != fwinfo.end()) {
+      try {
+	Node const & status = addressTable->getNode(itStatus->second);
+	health->hasStatus  = true;
+	health->statusAddr = status.getAddress();
+	health->statusMask = status.getMask();
+      } catch (uhal::exception::exception & e) {
+	log (Notice(), "UIO: unknown link_status node \"", itStatus->second, "\" for ", aNodeId);
+      }
+    }
+    //Probe register: fwinfo="uio_endpoint;probe=C2C1.STATUS.ID", any register
+    //that can be read without side effects (not a FIFO or clear-on-read)
+    auto itProbe = fwinfo.find("probe");
+    if (itProbe != fwinfo.end()) {
+      try {
+	health->probeAddr = addressTable->getNode(itProbe->second).getAddress();
+	health->hasProbe  = true;
+      } catch (uhal::exception::exception & e) {
+	log (Notice(), "UIO: unknown probe node \"", itProbe->second, "\" for ", aNodeId);
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(healthMutex);
+      //a remapped endpoint starts over
+      size_t iHealth = 0;
+      while ((iHealth < endpointHealth.size()) && (endpointHealth[iHealth]->name != aNodeId)) {
+	iHealth++;
+      }
+      if (iHealth < endpointHealth.size()) {
+	endpointHealth[iHealth] = health;
+      } else {
+	endpointHealth.push_back(health);
+      }
+    }
+    if (health->hasStatus) {
+      startHealthMonitor();
+    }
+    return health;
+  }
+
+  bool UIO::endpointUp (std::string const & aNodeId) {
+    std::lock_guard<std::mutex> lock(healthMutex);
+    for (size_t iHealth = 0; iHealth < endpointHealth.size(); iHealth++) {
+      if (endpointHealth[iHealth]->name == aNodeId) {
+	return !endpointHealth[iHealth]->down;
+      }
+    }
+    uhal::exception::UIODevOOR lExc;
+    log (lExc, "Unknown endpoint ", aNodeId);
+    throw lExc;
+  }
+
+  void UIO::resetEndpoint (std::string const & aNodeId) {
+    std::lock_guard<std::mutex> lock(healthMutex);
+    for (size_t iHealth = 0; iHealth < endpointHealth.size(); iHealth++) {
+      sEndpointHealth & health = *endpointHealth[iHealth];
+      if (health.name == aNodeId) {
+	health.faults = 0;
+	if (health.down.exchange(false)) {
+	  log (Notice(), "UIO: endpoint ", health.name, " re-enabled");
+	}
+	return;
+      }
+    }
+    uhal::exception::UIODevOOR lExc;
+    log (lExc, "Unknown endpoint ", aNodeId);
+    throw lExc;
+  }
+
+  void UIO::recordFault (sEndpointHealth & aHealth) {
+    uint32_t faults = ++aHealth.faults;
+    if ((0 == faultThreshold) || (faults < faultThreshold)) {
+      return;
+    }
+    if (!aHealth.down.exchange(true)) {
+      log (Error(), "UIO: endpoint ", aHealth.name, " marked down after ",
+	   Integer(faults), " consecutive bus errors");
+      if (aHealth.hasStatus || aHealth.hasProbe) {
+	startHealthMonitor();
+      }
+    }
+  }
+
+  bool UIO::linkStatusUp (sEndpointHealth const & aHealth) {
+    try {
+      //read past the fast fail, the register may sit in the endpoint it guards
+      sUIODevice const & dev = lookupDevice(aHealth.statusAddr);
+      uint32_t volatile * reg = dev.hw + (aHealth.statusAddr - dev.uhalAddr);
+      uint32_t status;
+      busGuard([&] {status = *reg;}, "Link status");
+      return (status & aHealth.statusMask) == aHealth.statusMask;
+    } catch (uhal::exception::exception & e) {
+      return false;
+    }
+  }
+
+  bool UIO::probeEndpoint (sEndpointHealth const & aHealth) {
+    if (aHealth.hasStatus) {
+      return linkStatusUp(aHealth);
+    }
+    //Only a declared register is read: an arbitrary word may be a FIFO or
+    //clear on read.  Without one the endpoint waits for resetEndpoint().
+    if (!aHealth.hasProbe) {
+      return false;
+    }
+    try {
+      sUIODevice const & dev = lookupDevice(aHealth.probeAddr);
+      uint32_t volatile * reg = dev.hw + (aHealth.probeAddr - dev.uhalAddr);
+      uint32_t value;
+      busGuard([&] {value = *reg;}, "Link probe");
+      (void) value;
+      return true;
+    } catch (uhal::exception::exception & e) {
+      return false;
+    }
+  }
+
+  void UIO::startHealthMonitor () {
+    std::lock_guard<std::mutex> lock(healthMutex);
+    if (!healthActive || healthStop || healthThread.joinable()) {
+      return;
+    }
+    healthThread = std::thread(&UIO::healthLoop, this);
+  }
+
+  void UIO::stopHealthMonitor () {
+    {
+      std::lock_guard<std::mutex> lock(healthMutex);
+      healthStop = true;
+    }
+    healthCond.notify_all();
+    if (healthThread.joinable()) {
+      healthThread.join();
+    }
+  }
+
+  void UIO::healthLoop () {
+    std::vector<std::shared_ptr<sEndpointHealth> > endpoints;
+    while (true) {
+      {
+	std::unique_lock<std::mutex> lock(healthMutex);
+	healthCond.wait_for(lock, probePeriod, [this] {return healthStop;});
+	if (healthStop) {
+	  break;
+	}
+	endpoints = endpointHealth;
+      }
+
+      DeviceFence fence(fenceLock());
+      for (size_t iHealth = 0; iHealth < endpoints.size(); iHealth++) {
+	sEndpointHealth & health = *endpoints[iHealth];
+	if (health.down && (health.hasStatus || health.hasProbe)) {
+	  //the probe may stall for an AXI timeout, that is fine on this thread
+	  if (probeEndpoint(health)) {
+	    health.faults = 0;
+	    health.down = false;
+	    log (Notice(), "UIO: endpoint ", health.name, " is up again");
+	  }
+	} else if (health.hasStatus && !linkStatusUp(health)) {
+	  if (!health.down.exchange(true)) {
+	    log (Error(), "UIO: endpoint ", health.name, " marked down, link status check failed");
+	  }
+	}
+      }
+    }
+  }
+
+}   // namespace uhal
@@ -49,6 +49,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
 #include <uhal/Node.hpp>
@@ -69,23 +70,97 @@
 
 namespace uioaxi {
 
+  sUIOFile::sUIOFile(int _fd) :
+    fd(_fd),
+    rdev(0),
+    ino(0){
+    //remember which device node this is, a reloaded device gets a new one
+    struct stat st;
+    if ((fd != -1) && (0 == fstat(fd, &st))) {
+      rdev = st.st_rdev;
+      ino  = st.st_ino;
+    }
+  }
+
+  sUIOFile::~sUIOFile()
+  {
+    if(fd != -1){
+      close(fd);
+    }
+  }
+
   sUIODevice::sUIODevice() : 
-    fd(-1),
     hw(NULL),
-    size(0){
+    addr(0),
+    uhalAddr(0),
+    size(0),
+    offset(0),
+    mapBytes(0),
+    mapIndex(0),
+    rmwReadback(true),
+    busDomain(0){
   }
   
   sUIODevice::~sUIODevice()
   {
     if(NULL != hw) {
-      munmap((void *)(hw),size);
-    }
-    if(fd != -1){
-      close(fd);
+      munmap((void *)((char volatile *)hw - offset), mapBytes);
     }
   }  
 }//uioaxi namespace
 
+//Read a hex value from a sysfs file (e.g. /sys/class/uio/uio0/maps/map0/addr)
+bool uioaxi::readSysfsHex(std::string const & path, uint64_t & value){
+  char valuechar[128]="";
+  FILE * valuefile = fopen(path.c_str(),"r");
+  if (valuefile == NULL) {
+    return false;
+  }
+  char * ret = fgets(valuechar, 128, valuefile);
+  fclose(valuefile);
+  if (ret == NULL) {
+    return false;
+  }
+  value = std::strtoull(valuechar, 0, 16);
+  return true;
+}
+
+bool uioaxi::readUIOMap(std::string const & aUIOName, size_t aMap, sUIOMapInfo & aInfo){
+  std::string mapPath = "/sys/class/uio/" + aUIOName + "/maps/map" + std::to_string(aMap);
+  uint64_t address = 0, size = 0, offset = 0;
+  if (!readSysfsHex(mapPath+"/addr", address) ||
+      !readSysfsHex(mapPath+"/size", size)) {
+    return false;
+  }
+  //a map that does not start on a page boundary is mapped from the page
+  //holding it; older kernels have no offset file and only aligned maps
+  readSysfsHex(mapPath+"/offset", offset);
+  aInfo.addr     = address + offset;
+  aInfo.offset   = offset;
+  aInfo.mapBytes = size;
+  //the size was in number of bytes, convert into number of uint32
+  aInfo.size     = (size > offset) ? size_t((size - offset)/4) : 0;
+  return true;
+}
+
+
+//Lock the pages holding [aPtr, aPtr + aBytes) in memory
+static void lockRange(void const * aPtr, size_t aBytes){
+  if ((NULL == aPtr) || (0 == aBytes)) {
+    return;
+  }
+  uintptr_t page  = getpagesize();
+  uintptr_t start = uintptr_t(aPtr) & ~(page - 1);
+  uintptr_t end   = (uintptr_t(aPtr) + aBytes + page - 1) & ~(page - 1);
+  if (0 != mlock((void *) start, end - start)) {
+    uhal::log ( uhal::Notice(), "UIO: real-time mode could not lock client memory: ", strerror(errno));
+  }
+}
+
+template<typename T>
+static void lockVector(std::vector<T> const & aVector){
+  lockRange(aVector.data(), aVector.capacity()*sizeof(T));
+}
 
 using namespace uioaxi;
 using namespace boost::filesystem;
@@ -136,7 +211,16 @@ namespace uhal {
     return address;
   }
 
-  int UIO::symlinkFindUIO(std::string nodeId, uint32_t nodeAddress) {
+  std::string UIO::findUIO(std::string const & nodeId) {
+    // try the simple method using "linux,uio-name" patch, else use the complex method (iterating thru dirs)
+    std::string uioName;
+    if (!symlinkFindUIO(nodeId, uioName)) {
+      uioName = dtFindUIO(nodeId);
+    }
+    return uioName;
+  }
+
+  int UIO::symlinkFindUIO(std::string nodeId, std::string & foundName) {
     // check if debug mode is enabled
     char* UIOUHAL_DEBUG = getenv("UIOUHAL_DEBUG");
     int size = 0;
@@ -211,51 +295,26 @@ namespace uhal {
       }
       log(Debug(), "Errror: Simple UIO finding method could load device ", nodeId.c_str(), "cannot find device or size 0");
     }
-    // finally, save the mapping
-    sUIODevice device;
-    devices[nodeAddress] = device;
-    devices[nodeAddress].uhalAddr = nodeAddress;
-    devices[nodeAddress].addr = address;
-    devices[nodeAddress].uioName = uioName;
-    devices[nodeAddress].hwNodeName = nodeId;
-    devices[nodeAddress].size = size;
-
-    // map the memory
-    openDevice(devices[nodeAddress]);
-    
-
-    if (NULL != getenv("UIOUHAL_DEBUG")) {
-      printf("Added:\n");
-      printf("  uhal addr: 0x%08X\n",devices[nodeAddress].uhalAddr);
-      printf("  addr:      0x%016" PRIX64 "\n",devices[nodeAddress].addr);
-      printf("  uio name:  \"%s\"\n",devices[nodeAddress].uioName.c_str());
-      printf("  hw  name:  \"%s\"\n",devices[nodeAddress].hwNodeName.c_str());
-      printf("  size:      0x%08zX\n",devices[nodeAddress].size);
-      printf("  map:       %p\n"    ,devices[nodeAddress].hw);
+    if (NULL != UIOUHAL_DEBUG) {
+      printf("Found %s at 0x%016" PRIX64 "\n", uioName.c_str(), address);
     }
-
-    //Check that the device (will throw if it is bad)
-    checkDevice(devices[nodeAddress]);
-
-    
+    foundName = deviceFile;
     return 1;
   }
 
-  void UIO::dtFindUIO( std::string nodeId, uint32_t nodeAddress) {
+  std::string UIO::dtFindUIO( std::string nodeId) {
     if (NULL != getenv("UIOUHAL_DEBUG")) {
       printf("Using legacy method for UIO device mapping: %s\n", nodeId.c_str());
     }
     // copied from Siqi's original code
-    int size = 0;
     std::string uioName;
-    char sizechar[128]="", addrchar[128]="";
+    char addrchar[128]="";
     uint64_t address1 = 0, address2 = 0;
 
     // iterate thru filesys to get the matching uio device 
     std::string uiopath = "/sys/class/uio/";
     std::string dvtpath = "/proc/device-tree/";
     FILE *addrfile=0;
-    FILE *sizefile=0;
     // loop over all amba, amba_pl paths
     for (directory_iterator itDVTPath(dvtpath); itDVTPath!=directory_iterator(); ++itDVTPath) {
       //Check that this is a path with amba in its name
@@ -289,67 +348,186 @@ namespace uhal {
 
       address2 = std::strtoull( addrchar, 0, 16);
       if (address1 == address2) {
-        sizefile = fopen((x->path().native()+"/maps/map0/size").c_str(),"r");
-        fgets(sizechar,128,sizefile); fclose(sizefile);
-        //the size was in number of bytes, convert into number of uint32
-        size=std::strtoul( sizechar, 0, 16)/4;  
         //strcpy(uioName,x->path().filename().native().c_str());
         uioName = x->path().filename().native();
         break;
       }
     }
 
-    // finally, save the mapping
-    sUIODevice device;
-    devices[nodeAddress] = device;
-    devices[nodeAddress].uhalAddr = nodeAddress;
-    devices[nodeAddress].addr = address1;
-    devices[nodeAddress].uioName = uioName;
-    devices[nodeAddress].hwNodeName = nodeId;
-    devices[nodeAddress].size = size;
-
-    // map the memory
-    openDevice(devices[nodeAddress]);
-    
-
     if (NULL != getenv("UIOUHAL_DEBUG")) {
-      printf("Added:\n");
-      printf("  uhal addr: 0x%08X\n",devices[nodeAddress].uhalAddr);
-      printf("  addr:      0x%016" PRIX64 "\n",devices[nodeAddress].addr);
-      printf("  uio name:  \"%s\"\n",devices[nodeAddress].uioName.c_str());
-      printf("  hw  name:  \"%s\"\n",devices[nodeAddress].hwNodeName.c_str());
-      printf("  size:      0x%08zX\n",devices[nodeAddress].size);
-      printf("  map:       %p\n"    ,devices[nodeAddress].hw);
+      printf("Found %s at 0x%016" PRIX64 "\n", uioName.c_str(), address1);
     }
+    return uioName;
+  }
 
-    //Check that the device (will throw if it is bad)
-    checkDevice(devices[nodeAddress]);
+  void UIO::addDevice(std::string const & nodeId, uint32_t nodeAddress,
+		      std::string const & uioName) {
+    // collect every map the uio device exposes: /sys/class/uio/uioN/maps/mapM
+    std::vector<sUIOMapInfo> maps;
+    sUIOMapInfo map;
+    for (size_t iMap = 0; !uioName.empty() && readUIOMap(uioName, iMap, map); iMap++) {
+      maps.push_back(map);
+    }
+    if (maps.empty()) {
+      // nothing found, openDevice/checkDevice will report the failure
+      sUIOMapInfo none = {0, 0, 0, 0};
+      maps.push_back(none);
+    }
 
-  }
+    // all maps share one file descriptor
+    std::shared_ptr<sUIOFile> file = openFile(uioName);
 
+    for (size_t iMap = 0; iMap < maps.size(); iMap++) {
+      // map0 sits at the endpoint's uhal address, the others follow at their
+      // AXI offset from map0
+      if (maps[iMap].addr < maps[0].addr) {
+	log (Notice(), "Skipping map", Integer(uint32_t(iMap)), " of ", uioName,
+	     ": it is below map0 and cannot be placed in the uhal address space");
+	continue;
+      }
+      uint64_t uhalStart = uint64_t(nodeAddress) + (maps[iMap].addr - maps[0].addr)/4;
+      uint64_t uhalEnd   = uhalStart + std::max(maps[iMap].size, size_t(1));
+      if (uhalEnd > (uint64_t(1) << 32)) {
+	uhal::exception::BadUIODevice lExc;
+	log (lExc, "Map", Integer(uint32_t(iMap)), " of ", uioName.c_str(), " for ", nodeId.c_str(),
+	     " does not fit in the 32 bit uhal address space");
+	throw lExc;
+      }
+      uint32_t uhalAddr = uint32_t(uhalStart);
+
+      // refuse maps that would shadow (part of) a map that is already placed
+      auto itHit = devices.lower_bound(uhalAddr);
+      bool overlap = (itHit != devices.end()) && (itHit->first < uhalEnd);
+      if (!overlap && (itHit != devices.begin())) {
+	--itHit;
+	overlap = (uint64_t(itHit->first) + std::max(itHit->second.size, size_t(1))) > uhalStart;
+      }
+      if (overlap) {
+	uhal::exception::BadUIODevice lExc;
+	log (lExc, "Map", Integer(uint32_t(iMap)), " of ", uioName.c_str(), " for ", nodeId.c_str(),
+	     " at uhal address ", Integer(uhalAddr, IntFmt<hex,fixed>()),
+	     " overlaps map", Integer(itHit->second.mapIndex), " of ", itHit->second.uioName.c_str(),
+	     " for ", itHit->second.hwNodeName.c_str());
+	throw lExc;
+      }
 
-  void UIO::openDevice(sUIODevice & dev) {
-    std::string devpath = "/dev/" + dev.uioName;
-    dev.fd = open(devpath.c_str(), O_RDWR|O_SYNC);
-    if (-1==dev.fd) {
+      sUIODevice & dev = devices[uhalAddr];
+      dev.file = file;
+      dev.uhalAddr = uhalAddr;
+      dev.addr = maps[iMap].addr;
+      dev.uioName = uioName;
+      dev.hwNodeName = nodeId;
+      dev.size = maps[iMap].size;
+      dev.offset = maps[iMap].offset;
+      dev.mapBytes = maps[iMap].mapBytes;
+      dev.mapIndex = iMap;
+
+      // map the memory
+      openDevice(dev);
+
+      if (NULL != getenv("UIOUHAL_DEBUG")) {
+	printf("Added:\n");
+	printf("  uhal addr: 0x%08X\n",dev.uhalAddr);
+	printf("  addr:      0x%016" PRIX64 "\n",dev.addr);
+	printf("  uio name:  \"%s\"\n",dev.uioName.c_str());
+	printf("  hw  name:  \"%s\"\n",dev.hwNodeName.c_str());
+	printf("  map:       %u\n",dev.mapIndex);
+	printf("  size:      0x%08zX\n",dev.size);
+	printf("  offset:    0x%08zX\n",dev.offset);
+	printf("  ptr:       %p\n"    ,dev.hw);
+      }
+
+      //Check that the device (will throw if it is bad)
+      checkDevice(dev);
+    }
+  }
+
+  std::shared_ptr<sUIOFile> UIO::openFile(std::string const & uioName) {
+    std::string devpath = "/dev/" + uioName;
+    int fd = open(devpath.c_str(), O_RDWR|O_SYNC);
+    if (-1==fd) {
       uhal::exception::BadUIODevice lExc;
       log( lExc , "Failed to open ", devpath, ": ", strerror(errno));
       throw lExc;
     }
-    dev.hw = (uint32_t*)mmap(NULL, dev.size*sizeof(uint32_t),
-			                      PROT_READ|PROT_WRITE, MAP_SHARED,
-			                      dev.fd, 0x0);
-    if (dev.hw==MAP_FAILED) {
+    return std::make_shared<sUIOFile>(fd);
+  }
+
+  void UIO::openDevice(sUIODevice & dev) {
+    std::string devpath = "/dev/" + dev.uioName;
+    // UIO selects map N with an mmap offset of N pages
+    off_t mapOffset = off_t(dev.mapIndex)*getpagesize();
+
+    int mapFlags = MAP_SHARED;
+    if (realtime) {
+      // fault every page in now rather than on first access
+      mapFlags |= MAP_POPULATE;
+    }
+    void * map = mmap(NULL, dev.mapBytes,
+		      PROT_READ|PROT_WRITE, mapFlags,
+		      dev.file->fd, mapOffset);
+    if (map==MAP_FAILED) {
       uhal::exception::BadUIODevice lExc;
-      log ( lExc , "Failed to map ", devpath, ": ",  strerror(errno));
+      log ( lExc , "Failed to map ", devpath, " map", Integer(dev.mapIndex), ": ",  strerror(errno));
       dev.hw=NULL;
       throw lExc;
     }
-    log ( Debug(), "Mapped ", devpath,
+    // the registers start offset bytes into the first page
+    dev.hw = (uint32_t volatile *)((char *)map + dev.offset);
+    if (realtime && (0 != mlock(map, dev.mapBytes))) {
+      log ( Notice(), "Failed to lock ", devpath, " map", Integer(dev.mapIndex), ": ", strerror(errno));
+    }
+    log ( Debug(), "Mapped ", devpath, " map", Integer(dev.mapIndex),
 	  " size ", Integer( dev.size, IntFmt<hex, fixed>()));
     
   }
 
+  void UIO::setupRealtime() {
+    // Reserve the per-dispatch bookkeeping up front so steady state accesses
+    // never grow a vector
+    size_t depth = 1024;
+    char* UIOUHAL_REALTIME_DEPTH = getenv("UIOUHAL_REALTIME_DEPTH");
+    if (NULL != UIOUHAL_REALTIME_DEPTH) {
+      depth = std::strtoul(UIOUHAL_REALTIME_DEPTH, 0, 0);
+    }
+    valwords.reserve(depth);
+    rmwBatch.transactions.reserve(depth);
+    rmwBatch.words.reserve(depth);
+    if (pendingBatch) {
+      pendingBatch->transactions.reserve(depth);
+      pendingBatch->words.reserve(depth);
+      pendingBatch->order.reserve(depth);
+    }
+    rmwBatch.order.reserve(depth);
+
+    // Lock the client's own state in memory, not the whole process.  The
+    // register maps themselves were populated and locked by openDevice.
+    lockRange(this, sizeof(*this));
+    lockVector(valwords);
+    lockVector(rmwBatch.transactions);
+    lockVector(rmwBatch.words);
+    lockVector(rmwBatch.order);
+    if (pendingBatch) {
+      lockRange(pendingBatch.get(), sizeof(sBatch));
+      lockVector(pendingBatch->transactions);
+      lockVector(pendingBatch->words);
+      lockVector(pendingBatch->order);
+    }
+    lockDevices();
+    log ( Debug(), "UIO: real-time mode, bookkeeping depth ", Integer(depth));
+  }
+
+  void UIO::lockDevices() {
+    // everything an access touches on its way to the register: the map's
+    // node in devices (looked up per access) and the endpoint's health
+    for (auto itDev = devices.begin(); itDev != devices.end(); itDev++) {
+      lockRange(&(*itDev), sizeof(*itDev));
+      if (itDev->second.health) {
+	lockRange(itDev->second.health.get(), sizeof(sEndpointHealth));
+      }
+    }
+  }
+
   int UIO::checkDevice (sUIODevice & dev) {
     if (dev.hw == NULL) {
       // include name of device in log output:
@@ -0,0 +1,198 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <exception>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+namespace uhal {  
+
+  uint32_t UIO::busDomainIndex (std::string const & aDomain) {
+    std::map<std::string,uint32_t>::iterator itDomain = busDomains.find(aDomain);
+    if (itDomain == busDomains.end()) {
+      itDomain = busDomains.insert(std::make_pair(aDomain, uint32_t(busDomains.size()))).first;
+    }
+    return itDomain->second;
+  }
+
+  void UIO::startDispatchPool (size_t aThreads, std::vector<int> const & aCPUs) {
+    if (!pendingBatch) {
+      pendingBatch.reset(new sBatch);
+    }
+    poolStop = false;
+    poolGeneration = 0;
+    poolBatch = NULL;
+    poolPartitions = NULL;
+    poolCount = 0;
+    poolNext = 0;
+    poolRemaining = 0;
+    //guarded accesses must not serialize on uhal::SigBusGuard's global lock
+    threadGuard = true;
+    deferDispatch = true;
+    for (size_t iThread = 0; iThread < aThreads; iThread++) {
+      poolThreads.push_back(std::thread(&UIO::poolWorker, this));
+      if (!aCPUs.empty()) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(aCPUs[iThread % aCPUs.size()], &cpus);
+	int ret = pthread_setaffinity_np(poolThreads.back().native_handle(), sizeof(cpus), &cpus);
+	if (0 != ret) {
+	  log (Notice(), "UIO: failed to pin dispatch thread to cpu ",
+	       Integer(aCPUs[iThread % aCPUs.size()]), ": ", strerror(ret));
+	}
+      }
+    }
+    log ( Debug(), "UIO: parallel dispatch with ", Integer(uint32_t(aThreads)), " threads over ",
+	  Integer(uint32_t(busDomains.size())), " bus domains");
+  }
+
+  void UIO::stopDispatchPool () {
+    if (poolThreads.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(poolMutex);
+      poolStop = true;
+    }
+    poolCond.notify_all();
+    for (size_t iThread = 0; iThread < poolThreads.size(); iThread++) {
+      poolThreads[iThread].join();
+    }
+    poolThreads.clear();
+  }
+
+  void UIO::poolWorker () {
+    uint64_t generation = 0;
+    while (true) {
+      {
+	std::unique_lock<std::mutex> lock(poolMutex);
+	poolCond.wait(lock, [&] {return poolStop || (poolGeneration != generation);});
+	if (poolStop) {
+	  return;
+	}
+	generation = poolGeneration;
+      }
+      while (runNextPartition(generation)) {
+      }
+    }
+  }
+
+  bool UIO::runNextPartition (uint64_t aGeneration) {
+    size_t iPartition;
+    sBatch * batch;
+    std::vector<size_t> * partition;
+    {
+      //claim a partition of the current job, if there is one left
+      std::lock_guard<std::mutex> lock(poolMutex);
+      if ((aGeneration != poolGeneration) || (NULL == poolPartitions) ||
+	  (poolNext >= poolCount)) {
+	return false;
+      }
+      iPartition = poolNext++;
+      batch      = poolBatch;
+      partition  = &(*poolPartitions)[iPartition];
+    }
+
+    std::exception_ptr error;
+    try {
+      executeTransactions(*batch, *partition);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    poolErrors[iPartition] = error;
+    if (0 == --poolRemaining) {
+      poolDoneCond.notify_all();
+    }
+    return true;
+  }
+
+  void UIO::runPartitions (sBatch & aBatch, std::vector<std::vector<size_t> > & aPartitions,
+			   size_t aCount) {
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(poolMutex);
+      poolBatch      = &aBatch;
+      poolPartitions = &aPartitions;
+      poolCount      = aCount;
+      poolNext       = 0;
+      poolRemaining  = aCount;
+      countedAssign(poolErrors, aCount, std::exception_ptr(), statAllocations);
+      generation     = ++poolGeneration;
+    }
+    poolCond.notify_all();
+
+    //the dispatching thread takes partitions too
+    while (runNextPartition(generation)) {
+    }
+
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(poolMutex);
+      poolDoneCond.wait(lock, [this] {return 0 == poolRemaining;});
+      poolBatch = NULL;
+      poolPartitions = NULL;
+      for (size_t i = 0; (i < poolErrors.size()) && !error; i++) {
+	error = poolErrors[i];
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+}   // namespace uhal
@@ -71,28 +71,36 @@
 using namespace uioaxi;
 using namespace boost::filesystem;
 
-#define BUS_ERROR_PROTECTION(ACCESS,ADDRESS) \
+#define BUS_ERROR_PROTECTION(ACCESS,ADDRESS,DEVICE) \
   if (true) {\
     char error_message[] = "Reg: 0x00000000"; \
     snprintf(error_message,strlen(error_message)+1,"Reg: 0x%08X",ADDRESS); \
-    uhal::SigBusGuard lGuard;\
-    lGuard.protect([&] {ACCESS;}, error_message);\
+    protectAccess(DEVICE, [&] {ACCESS;}, error_message);\
   }
 
 namespace uhal {  
 
-
-  ValHeader UIO::implementWrite (const uint32_t& aAddr, const uint32_t& aValue) {
-
+  sUIODevice const & UIO::lookupDevice (uint32_t aAddr, uint32_t aCount) {
     //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
+    std::map<uint32_t,sUIODevice>::const_iterator itDev = devices.upper_bound(aAddr);
+    if (itDev == devices.begin()){
+      //address is below the first endpoint
+      uhal::exception::UIODevOOR lExc;
+      log (lExc, "Address (",
+	   Integer(aAddr,IntFmt<hex,fixed>()),
+	   ") is below the first mapped endpoint");
+      throw lExc;
+    }
+    sUIODevice const & dev = (--itDev)->second;
 
     uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
+    if ((offset >= dev.size) || (aCount > (dev.size - offset))){
+      //offset (+ size) is ouside of mapped range
       uhal::exception::UIODevOOR lExc;
       log (lExc, "Address (",
 	   Integer(aAddr,IntFmt<hex,fixed>()),
+	   " + ",
+	   Integer(aCount),
 	   ") out of mapped range: ",
 	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
 	   " to ",
@@ -100,9 +108,205 @@ namespace uhal {
 	   );
       throw lExc;
     }
-    
-    
-    BUS_ERROR_PROTECTION(dev.hw[offset] = aValue,aAddr);
+    return dev;
+  }
+
+  // The accesses below go through a pointer to the register so that each
+  // BUS_ERROR_PROTECTION lambda captures at most two references.  That fits in
+  // std::function's small buffer, so a guarded access does not allocate.
+
+  void UIO::writeWord (uint32_t aAddr, uint32_t aValue) {
+    sUIODevice const & dev = lookupDevice(aAddr);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+    BUS_ERROR_PROTECTION(*reg = aValue,aAddr,dev)
+  }
+
+  uint32_t UIO::readWord (uint32_t aAddr) {
+    uint32_t publishedval;
+    if (shmReading.load(std::memory_order_relaxed) && readPublished(aAddr, publishedval)) {
+      //fresh copy published by another process, no bus access needed
+      return publishedval;
+    }
+    sUIODevice const & dev = lookupDevice(aAddr);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+    uint32_t readval;
+    BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+    return readval;
+  }
+
+  void UIO::writeBlock (uint32_t aAddr, uint32_t const * aValues, uint32_t aSize,
+			defs::BlockReadWriteMode aMode) {
+    sUIODevice const & dev = lookupDevice(aAddr,
+					  (aMode == defs::INCREMENTAL) ? aSize : 1);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+    for (uint32_t i = 0; i < aSize; i++) {
+      uint32_t value = aValues[i];
+      BUS_ERROR_PROTECTION(*reg = value,aAddr,dev)
+      if ( aMode == defs::INCREMENTAL ) {
+        reg ++;
+      }
+    }
+  }
+
+  void UIO::readBlock (uint32_t aAddr, uint32_t * aValues, uint32_t aSize,
+		       defs::BlockReadWriteMode aMode) {
+    sUIODevice const & dev = lookupDevice(aAddr,
+					  (aMode == defs::INCREMENTAL) ? aSize : 1);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+    for (uint32_t i = 0; i < aSize; i++) {
+      uint32_t readval;
+      BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+      aValues[i] = readval;
+      if ( aMode == defs::INCREMENTAL ) {
+	      reg ++;
+      }
+    }
+  }
+
+  uint32_t UIO::rmwBits (uint32_t aAddr, uint32_t aANDterm, uint32_t aORterm) {
+    sUIODevice const & dev = lookupDevice(aAddr);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+
+    //read the current value
+    uint32_t readval;
+    BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+
+    //apply and and or operations
+    readval &= aANDterm;
+    readval |= aORterm;
+    BUS_ERROR_PROTECTION(*reg = readval,aAddr,dev)
+    if (dev.rmwReadback) {
+      BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+    }
+    return readval;
+  }
+
+  uint32_t UIO::rmwSum (uint32_t aAddr, int32_t aAddend) {
+    sUIODevice const & dev = lookupDevice(aAddr);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+
+    //read the current value
+    uint32_t readval;
+    BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+    //apply the addition
+    readval += aAddend;
+    BUS_ERROR_PROTECTION(*reg = readval,aAddr,dev)
+    if (dev.rmwReadback) {
+      BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+    }
+    return readval;
+  }
+
+  void UIO::rmwFused (uint32_t aAddr, sBatch & aBatch, std::vector<size_t> const & aIndices) {
+    sUIODevice const & dev = lookupDevice(aAddr);
+    uint32_t volatile * reg = dev.hw + (aAddr-dev.uhalAddr);
+
+    //one read for all the updates
+    uint32_t readval;
+    BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+    for (size_t i = 0; i < aIndices.size(); i++) {
+      sTransaction const & trans = aBatch.transactions[aIndices[i]];
+      if (trans.type == UIO_RMW_BITS) {
+	readval &= trans.value;
+	readval |= trans.orTerm;
+      } else {
+	readval += int32_t(trans.value);
+      }
+      //each RMW reports the value after its own update
+      aBatch.words[trans.index].value(readval);
+    }
+    //one write of the combined result
+    BUS_ERROR_PROTECTION(*reg = readval,aAddr,dev)
+    if (dev.rmwReadback) {
+      BUS_ERROR_PROTECTION(readval = *reg,aAddr,dev)
+      aBatch.words[aBatch.transactions[aIndices.back()].index].value(readval);
+    }
+    for (size_t i = 0; i < aIndices.size(); i++) {
+      aBatch.words[aBatch.transactions[aIndices[i]].index].valid(true);
+    }
+  }
+
+  void UIO::executeRMWRun (sBatch & aBatch, std::vector<size_t> const & aIndices,
+			   size_t aBegin, size_t aEnd) {
+    //Only neighbouring bit updates of the same register that touch different
+    //bits are fused, so the register sees the same final writes in the same
+    //order.  A set then clear of one bit (a pulse) or a sum still gets its
+    //own write.
+    static thread_local std::vector<size_t> group;
+    size_t i = aBegin;
+    while (i < aEnd) {
+      sTransaction const & first = aBatch.transactions[aIndices[i]];
+      group.clear();
+      countedPush(group, aIndices[i], statAllocations);
+      i++;
+      if (first.type == UIO_RMW_BITS) {
+	uint32_t touched = ~first.value | first.orTerm;
+	while (i < aEnd) {
+	  sTransaction const & next = aBatch.transactions[aIndices[i]];
+	  uint32_t nextTouched = ~next.value | next.orTerm;
+	  if ((next.type != UIO_RMW_BITS) || (next.addr != first.addr) ||
+	      (0 != (touched & nextTouched))) {
+	    break;
+	  }
+	  touched |= nextTouched;
+	  countedPush(group, aIndices[i], statAllocations);
+	  i++;
+	}
+      }
+      rmwFused(first.addr, aBatch, group);
+    }
+  }
+
+  void UIO::flushRMW () {
+    if (!rmwHeld.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(rmwMutex);
+    rmwHeld = false;
+    try {
+      executeBatch(rmwBatch);
+    } catch (...) {
+      rmwBatch.clear();
+      if (!rmwError) {
+	rmwError = std::current_exception();
+      }
+      log (Debug(), "UIO: held back RMW failed, reporting it at the next dispatch");
+      return;
+    }
+    rmwBatch.clear();
+  }
+
+
+  uint32_t UIO::readRegister (uint32_t aAddr) {
+    DeviceFence fence(fenceLock());
+    flushRMW();
+    statOperations++;
+    return readWord(aAddr);
+  }
+
+  void UIO::writeRegister (uint32_t aAddr, uint32_t aValue) {
+    DeviceFence fence(fenceLock());
+    flushRMW();
+    statOperations++;
+    writeWord(aAddr, aValue);
+  }
+
+  ValHeader UIO::implementWrite (const uint32_t& aAddr, const uint32_t& aValue) {
+    DeviceFence fence(fenceLock());
+    if (deferDispatch) {
+      lookupDevice(aAddr);
+      sTransaction & trans = queueTransaction(*pendingBatch, UIO_WRITE, aAddr);
+      trans.value = aValue;
+      primeDispatch();
+      return ValHeader();
+    }
+    flushRMW();
+    statOperations++;
+    writeWord(aAddr, aValue);
+    if (realtime) {
+      //shared header, avoids an allocation per write
+      return realtimeHeader;
+    }
     return ValHeader();
   }
 
@@ -117,99 +321,62 @@ namespace uhal {
   ValHeader UIO::implementWriteBlock (const uint32_t& aAddr,
 				      const std::vector<uint32_t>& aValues,
 				      const defs::BlockReadWriteMode& aMode) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
-    uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
-    }
-    if ((offset+ aValues.size()) >= dev.size){
-      //offset + size is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr+aValues.size(),IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
-    }
-
-    std::vector<uint32_t>::const_iterator ptr;
-    for (ptr = aValues.begin(); ptr < aValues.end(); ptr++) {
-      BUS_ERROR_PROTECTION(dev.hw[offset] = *ptr,aAddr)
-      if ( aMode == defs::INCREMENTAL ) {
-        offset ++;
+    DeviceFence fence(fenceLock());
+    if (deferDispatch) {
+      lookupDevice(aAddr, (aMode == defs::INCREMENTAL) ? aValues.size() : 1);
+      sTransaction & trans = queueTransaction(*pendingBatch, UIO_WRITE_BLOCK, aAddr);
+      trans.size  = aValues.size();
+      trans.mode  = aMode;
+      trans.index = pendingBatch->payload.size();
+      if (pendingBatch->payload.capacity() < trans.index + aValues.size()) {
+	statAllocations++;
       }
+      pendingBatch->payload.insert(pendingBatch->payload.end(),aValues.begin(),aValues.end());
+      primeDispatch();
+      return ValHeader();
     }
+    flushRMW();
+    statOperations++;
+    writeBlock(aAddr, aValues.data(), aValues.size(), aMode);
     return ValHeader();
   }
 
   ValWord<uint32_t> UIO::implementRead (const uint32_t& aAddr, const uint32_t& aMask) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
-    uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
+    DeviceFence fence(fenceLock());
+    if (deferDispatch) {
+      lookupDevice(aAddr);
+      sTransaction & trans = queueTransaction(*pendingBatch, UIO_READ, aAddr);
+      trans.index = pendingBatch->words.size();
+      countedPush(pendingBatch->words, ValWord<uint32_t>(0, aMask), statAllocations);
+      primeDispatch();
+      return pendingBatch->words.back();
     }
-
-    uint32_t readval;
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    ValWord<uint32_t> vw(readval, aMask);
-    valwords.push_back(vw);
+    flushRMW();
+    statOperations++;
+    ValWord<uint32_t> vw(readWord(aAddr), aMask);
+    countedPush(valwords, vw, statAllocations);
     primeDispatch();
     return vw;
   }
     
   ValVector< uint32_t > UIO::implementReadBlock (const uint32_t& aAddr, const uint32_t& aSize, const defs::BlockReadWriteMode& aMode) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
-    uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
-    }
-
-    std::vector<uint32_t> read_vector(aSize);
-    std::vector<uint32_t>::iterator ptr;
-    for (ptr = read_vector.begin(); ptr < read_vector.end(); ptr++) {
-      uint32_t readval;
-      BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-      *ptr = readval;
-      if ( aMode == defs::INCREMENTAL ) {
-	      offset ++;
-      }
+    DeviceFence fence(fenceLock());
+    if (deferDispatch) {
+      lookupDevice(aAddr, (aMode == defs::INCREMENTAL) ? aSize : 1);
+      sTransaction & trans = queueTransaction(*pendingBatch, UIO_READ_BLOCK, aAddr);
+      trans.size  = aSize;
+      trans.mode  = aMode;
+      trans.index = pendingBatch->blocks.size();
+      countedPush(pendingBatch->blocks, ValVector<uint32_t>(), statAllocations);
+      primeDispatch();
+      return pendingBatch->blocks.back();
     }
+    flushRMW();
+    statOperations++;
+    //reused scratch, the ValVector takes its own copy
+    static thread_local std::vector<uint32_t> read_vector;
+    countedResize(read_vector, aSize, statAllocations);
+    readBlock(aAddr, read_vector.data(), aSize, aMode);
     return ValVector< uint32_t> (read_vector);
   }
 
@@ -227,68 +394,82 @@ namespace uhal {
   void UIO::implementDispatch (boost::shared_ptr<Buffers> /*aBuffers*/) {
 #endif
     log ( Debug(), "UIO: Dispatch");
+    DeviceFence fence(fenceLock());
+    if (asyncDispatch) {
+      //hand the queued transactions to the worker thread and return
+      submitBatch();
+      return;
+    }
+    if (deferDispatch) {
+      //parallel dispatch: run the queued transactions now
+      sBatch & batch = *pendingBatch;
+      try {
+	executeBatch(batch);
+      } catch (...) {
+	batch.clear();
+	throw;
+      }
+      batch.clear();
+      return;
+    }
+    flushRMW();
     for (unsigned int i=0; i<valwords.size(); i++)
       valwords[i].valid(true);
     valwords.clear();
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(rmwMutex);
+      std::swap(error, rmwError);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
 
   ValWord<uint32_t> UIO::implementRMWbits (const uint32_t& aAddr , const uint32_t& aANDterm , const uint32_t& aORterm) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
-    uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
+    DeviceFence fence(fenceLock());
+    lookupDevice(aAddr);
+    //held back (or queued) so it can be fused with other updates of this register
+    std::unique_lock<std::mutex> lock(rmwMutex, std::defer_lock);
+    if (!deferDispatch) {
+      lock.lock();
     }
-    
-    //read the current value
-    uint32_t readval;
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-
-    //apply and and or operations
-    readval &= aANDterm;
-    readval |= aORterm;
-    BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    return ValWord<uint32_t>(readval);
+    sBatch & batch = deferDispatch ? *pendingBatch : rmwBatch;
+    sTransaction & trans = queueTransaction(batch, UIO_RMW_BITS, aAddr);
+    trans.value  = aANDterm;
+    trans.orTerm = aORterm;
+    trans.index  = batch.words.size();
+    countedPush(batch.words, ValWord<uint32_t>(0), statAllocations);
+    ValWord<uint32_t> word = batch.words.back();
+    if (!deferDispatch) {
+      rmwHeld = true;
+      lock.unlock();
+    }
+    primeDispatch();
+    return word;
   }
 
 
   ValWord<uint32_t> UIO::implementRMWsum (const uint32_t& aAddr, const int32_t& aAddend) {
-    //Get the device
-    sUIODevice const & dev = (--(devices.upper_bound(aAddr)))->second;
-
-    uint32_t offset = aAddr-dev.uhalAddr;
-    if (offset >= dev.size){
-      //offset is ouside of mapped range
-      uhal::exception::UIODevOOR lExc;
-      log (lExc, "Address (",
-	   Integer(aAddr,IntFmt<hex,fixed>()),
-	   ") out of mapped range: ",
-	   Integer(dev.uhalAddr,IntFmt<hex,fixed>()),
-	   " to ",
-	   Integer(dev.uhalAddr+dev.size,IntFmt<hex,fixed>())
-	   );
-      throw lExc;
+    DeviceFence fence(fenceLock());
+    lookupDevice(aAddr);
+    //held back (or queued) so it can be fused with other updates of this register
+    std::unique_lock<std::mutex> lock(rmwMutex, std::defer_lock);
+    if (!deferDispatch) {
+      lock.lock();
     }
-
-    //read the current value
-    uint32_t readval;
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    //apply and and or operations
-    readval += aAddend;
-    BUS_ERROR_PROTECTION(dev.hw[offset] = readval,aAddr)
-    BUS_ERROR_PROTECTION(readval = dev.hw[offset],aAddr)
-    return ValWord<uint32_t>(readval);
+    sBatch & batch = deferDispatch ? *pendingBatch : rmwBatch;
+    sTransaction & trans = queueTransaction(batch, UIO_RMW_SUM, aAddr);
+    trans.value = aAddend;
+    trans.index = batch.words.size();
+    countedPush(batch.words, ValWord<uint32_t>(0), statAllocations);
+    ValWord<uint32_t> word = batch.words.back();
+    if (!deferDispatch) {
+      rmwHeld = true;
+      lock.unlock();
+    }
+    primeDispatch();
+    return word;
   }
 
   exception::exception* UIO::validate (uint8_t* /*aSendBufferStart*/,
@@ -299,4 +480,3 @@ namespace uhal {
   }
   
 }   // namespace uhal
-
@@ -0,0 +1,280 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <system_error>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+namespace uioaxi {
+
+  DeviceFence::DeviceFence(pthread_rwlock_t * aLock) :
+    lock(aLock){
+    if (NULL != lock) {
+      pthread_rwlock_rdlock(lock);
+    }
+  }
+
+  DeviceFence::~DeviceFence() {
+    if (NULL != lock) {
+      pthread_rwlock_unlock(lock);
+    }
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  bool UIO::endpointChanged (std::string const & aNodeId, std::string const & aUIOName) {
+    bool mapped = false;
+    size_t mappedCount = 0;
+    for (auto itDev = devices.begin(); itDev != devices.end(); itDev++) {
+      sUIODevice const & dev = itDev->second;
+      if (dev.hwNodeName != aNodeId) {
+	continue;
+      }
+      mapped = true;
+      mappedCount++;
+      if (dev.uioName != aUIOName) {
+	return true;
+      }
+      //a device that was removed and created again has a new node
+      struct stat st;
+      if ((0 != stat(("/dev/" + aUIOName).c_str(), &st)) ||
+	  (st.st_rdev != dev.file->rdev) || (st.st_ino != dev.file->ino)) {
+	return true;
+      }
+      sUIOMapInfo map;
+      if (!readUIOMap(aUIOName, dev.mapIndex, map) ||
+	  (map.addr != dev.addr) || (map.size != dev.size)) {
+	return true;
+      }
+    }
+    if (mapped) {
+      //the firmware may also have added or dropped maps.  Count the ones
+      //addDevice would place: those not below map0.
+      size_t sysfsCount = 0;
+      uint64_t map0 = 0;
+      sUIOMapInfo map;
+      for (size_t iMap = 0; readUIOMap(aUIOName, iMap, map); iMap++) {
+	if (0 == iMap) {
+	  map0 = map.addr;
+	}
+	if (map.addr >= map0) {
+	  sysfsCount++;
+	}
+      }
+      return sysfsCount != mappedCount;
+    }
+    //an endpoint that was missing may have come back
+    return !aUIOName.empty();
+  }
+
+  void UIO::removeEndpoint (std::string const & aNodeId) {
+    auto itDev = devices.begin();
+    while (itDev != devices.end()) {
+      if (itDev->second.hwNodeName == aNodeId) {
+	devices.erase(itDev++);
+      } else {
+	itDev++;
+      }
+    }
+  }
+
+  size_t UIO::reloadEndpoints () {
+    //walk the filesystem before fencing off the accesses
+    //(an empty name means the endpoint is gone)
+    std::vector<std::string> uioNames(endpoints.size());
+    std::vector<bool> lookupFailed(endpoints.size(), false);
+    for (size_t iEndpoint = 0; iEndpoint < endpoints.size(); iEndpoint++) {
+      try {
+	uioNames[iEndpoint] = findUIO(endpoints[iEndpoint].first);
+      } catch (std::exception & e) {
+	//the device tree is being rewritten: that says nothing about this
+	//endpoint, keep its mapping and look again on the next change
+	lookupFailed[iEndpoint] = true;
+	log (Debug(), "UIO: lookup of ", endpoints[iEndpoint].first, " failed: ", e.what());
+      }
+    }
+
+    size_t changed = 0;
+    pthread_rwlock_wrlock(&devicesLock);
+    for (size_t iEndpoint = 0; iEndpoint < endpoints.size(); iEndpoint++) {
+      std::string const & nodeId = endpoints[iEndpoint].first;
+      Node const & node = *endpoints[iEndpoint].second;
+      if (lookupFailed[iEndpoint] || !endpointChanged(nodeId, uioNames[iEndpoint])) {
+	continue;
+      }
+      changed++;
+      removeEndpoint(nodeId);
+      if (uioNames[iEndpoint].empty()) {
+	log (Notice(), "UIO: endpoint ", nodeId, " is gone");
+	continue;
+      }
+      try {
+	addDevice(nodeId, node.getAddress(), uioNames[iEndpoint]);
+	configureEndpoint(nodeId, node);
+	if (realtime) {
+	  lockDevices();
+	}
+	log (Notice(), "UIO: remapped endpoint ", nodeId, " to ", uioNames[iEndpoint]);
+      } catch (uhal::exception::exception & e) {
+	//leave it unmapped, the next change will try again
+	removeEndpoint(nodeId);
+	log (Notice(), "UIO: failed to remap endpoint ", nodeId, " to ", uioNames[iEndpoint]);
+      }
+    }
+    pthread_rwlock_unlock(&devicesLock);
+    return changed;
+  }
+
+  void UIO::startHotReload () {
+    reloadWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (-1 == reloadWakeFd) {
+      uhal::exception::BadUIODevice lExc;
+      log (lExc, "Failed to create hot reload eventfd: ", strerror(errno));
+      throw lExc;
+    }
+    hotReload = true;
+    try {
+      reloadThread = std::thread(&UIO::reloadLoop, this);
+    } catch (std::system_error & e) {
+      close(reloadWakeFd);
+      reloadWakeFd = -1;
+      throw;
+    }
+  }
+
+  void UIO::stopHotReload () {
+    if (!reloadThread.joinable()) {
+      return;
+    }
+    uint64_t wake = 1;
+    if (sizeof(wake) != ::write(reloadWakeFd, &wake, sizeof(wake))) {
+      log (Debug(), "UIO: failed to wake the hot reload thread: ", strerror(errno));
+    }
+    reloadThread.join();
+    close(reloadWakeFd);
+    reloadWakeFd = -1;
+  }
+
+  void UIO::reloadLoop () {
+    int watchFd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (-1 == watchFd) {
+      log (Error(), "UIO: hot reload failed to create inotify: ", strerror(errno));
+      return;
+    }
+    //uio nodes and their /dev/uio_NAME symlinks come and go in /dev.  sysfs
+    //does not always generate events, so /sys/class/uio is only a backup.
+    char const * watchPaths[] = {"/dev", "/sys/class/uio"};
+    for (size_t iPath = 0; iPath < sizeof(watchPaths)/sizeof(watchPaths[0]); iPath++) {
+      if (-1 == inotify_add_watch(watchFd, watchPaths[iPath], IN_CREATE|IN_DELETE|IN_MOVED_TO|IN_MOVED_FROM)) {
+	log (Debug(), "UIO: hot reload cannot watch ", watchPaths[iPath], ": ", strerror(errno));
+      }
+    }
+
+    //wait this long after the last uio event, udev adds the symlinks later
+    int settleMs = 100;
+    char* UIOUHAL_HOT_RELOAD_SETTLE_MS = getenv("UIOUHAL_HOT_RELOAD_SETTLE_MS");
+    if (NULL != UIOUHAL_HOT_RELOAD_SETTLE_MS) {
+      settleMs = std::strtol(UIOUHAL_HOT_RELOAD_SETTLE_MS, 0, 0);
+    }
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool pending = false;
+    while (true) {
+      struct pollfd fds[2] = {{watchFd, POLLIN, 0}, {reloadWakeFd, POLLIN, 0}};
+      int ready = poll(fds, 2, pending ? settleMs : -1);
+      if (ready < 0) {
+	if (EINTR == errno) {
+	  continue;
+	}
+	log (Error(), "UIO: hot reload poll failed: ", strerror(errno));
+	break;
+      }
+      if (fds[1].revents & POLLIN) {
+	break;
+      }
+      if (0 == ready) {
+	//things have settled, remap what changed
+	pending = false;
+	try {
+	  size_t changed = reloadEndpoints();
+	  log (Debug(), "UIO: hot reload remapped ", Integer(uint32_t(changed)), " endpoints");
+	} catch (std::exception & e) {
+	  log (Error(), "UIO: hot reload failed: ", e.what());
+	}
+	continue;
+      }
+      ssize_t length;
+      while (0 < (length = ::read(watchFd, buffer, sizeof(buffer)))) {
+	for (char * ptr = buffer; ptr < buffer + length;
+	     ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+	  struct inotify_event const * event = (struct inotify_event const *) ptr;
+	  if ((0 < event->len) && (0 == strncmp(event->name, "uio", 3))) {
+	    pending = true;
+	  }
+	}
+      }
+    }
+    close(watchFd);
+  }
+
+}   // namespace uhal
@@ -0,0 +1,330 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+static uint64_t monotonicNs(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec)*1000000000ULL + now.tv_nsec;
+}
+
+namespace uhal {  
+
+  size_t UIO::addSampleSet (std::vector<std::string> const & aNodes,
+			    std::chrono::nanoseconds aPeriod, size_t aDepth) {
+    if (aPeriod.count() <= 0) {
+      uhal::exception::BadSampleSet lExc;
+      log (lExc, "Sample period must be positive");
+      throw lExc;
+    }
+    sSampleSet set;
+    set.plan     = compileSnapshot(aNodes);
+    set.periodNs = aPeriod.count();
+    set.nextNs   = monotonicNs();
+    set.ring     = std::make_shared<SampleRing>(set.plan->addresses.size(), aDepth);
+
+    size_t id;
+    {
+      std::lock_guard<std::mutex> lock(samplerMutex);
+      sampleSets.push_back(set);
+      //the set of possible passes changed
+      samplePasses.clear();
+      id = sampleSets.size() - 1;
+    }
+    if (samplerThread.joinable()) {
+      //re-arm the timer with the new deadline
+      uint64_t wake = 1;
+      if (sizeof(wake) != ::write(samplerWakeFd, &wake, sizeof(wake))) {
+	log (Debug(), "UIO: failed to wake the sampler: ", strerror(errno));
+      }
+    }
+    return id;
+  }
+
+  std::shared_ptr<SampleRing const> UIO::getSampleRing (size_t aSet) {
+    std::lock_guard<std::mutex> lock(samplerMutex);
+    if (aSet >= sampleSets.size()) {
+      uhal::exception::BadSampleSet lExc;
+      log (lExc, "No sample set ", Integer(uint32_t(aSet)));
+      throw lExc;
+    }
+    return sampleSets[aSet].ring;
+  }
+
+  std::shared_ptr<sSnapshotPlan const> UIO::getSamplePlan (size_t aSet) {
+    std::lock_guard<std::mutex> lock(samplerMutex);
+    if (aSet >= sampleSets.size()) {
+      uhal::exception::BadSampleSet lExc;
+      log (lExc, "No sample set ", Integer(uint32_t(aSet)));
+      throw lExc;
+    }
+    return sampleSets[aSet].plan;
+  }
+
+  void UIO::startSampling () {
+    if (samplerThread.joinable()) {
+      return;
+    }
+    samplerWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (-1 == samplerWakeFd) {
+      uhal::exception::BadSampleSet lExc;
+      log (lExc, "Failed to create sampler eventfd: ", strerror(errno));
+      throw lExc;
+    }
+    samplerStop = false;
+    samplerThread = std::thread(&UIO::samplerLoop, this);
+  }
+
+  void UIO::stopSampling () {
+    if (!samplerThread.joinable()) {
+      return;
+    }
+    samplerStop = true;
+    uint64_t wake = 1;
+    if (sizeof(wake) != ::write(samplerWakeFd, &wake, sizeof(wake))) {
+      log (Debug(), "UIO: failed to wake the sampler: ", strerror(errno));
+    }
+    samplerThread.join();
+    close(samplerWakeFd);
+    samplerWakeFd = -1;
+  }
+
+  void UIO::samplerLoop () {
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (-1 == timerFd) {
+      log (Error(), "UIO: sampler failed to create timerfd: ", strerror(errno));
+      return;
+    }
+
+    std::vector<size_t> due;
+    //sets with a callback, called once the lock is released so they may use
+    //the client (e.g. getSampleRing) themselves
+    std::vector<std::pair<std::shared_ptr<SampleRing>,sSampleSet::Callback> > callbacks;
+    std::vector<uint32_t> sample;
+    while (!samplerStop) {
+      //arm the timer for the earliest deadline (absolute, so nothing drifts)
+      struct itimerspec deadline;
+      memset(&deadline, 0, sizeof(deadline));
+      {
+	std::lock_guard<std::mutex> lock(samplerMutex);
+	uint64_t nextNs = 0;
+	for (size_t iSet = 0; iSet < sampleSets.size(); iSet++) {
+	  if ((0 == nextNs) || (sampleSets[iSet].nextNs < nextNs)) {
+	    nextNs = sampleSets[iSet].nextNs;
+	  }
+	}
+	deadline.it_value.tv_sec  = nextNs / 1000000000ULL;
+	deadline.it_value.tv_nsec = nextNs % 1000000000ULL;
+      }
+      timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+      struct pollfd fds[2] = {{timerFd, POLLIN, 0}, {samplerWakeFd, POLLIN, 0}};
+      if (poll(fds, 2, -1) < 0) {
+	if (EINTR == errno) {
+	  continue;
+	}
+	log (Error(), "UIO: sampler poll failed: ", strerror(errno));
+	break;
+      }
+      uint64_t count;
+      if ((fds[0].revents & POLLIN) && (sizeof(count) != ::read(timerFd, &count, sizeof(count)))) {
+	log (Debug(), "UIO: sampler timerfd read failed: ", strerror(errno));
+      }
+      if ((fds[1].revents & POLLIN) && (sizeof(count) != ::read(samplerWakeFd, &count, sizeof(count)))) {
+	log (Debug(), "UIO: sampler eventfd read failed: ", strerror(errno));
+      }
+      if (samplerStop) {
+	break;
+      }
+
+      //nothing may escape the thread: it would terminate the process
+      try {
+	uint64_t nowNs = monotonicNs();
+	callbacks.clear();
+	{
+	  std::lock_guard<std::mutex> lock(samplerMutex);
+	  due.clear();
+	  for (size_t iSet = 0; iSet < sampleSets.size(); iSet++) {
+	    if (sampleSets[iSet].nextNs <= nowNs) {
+	      due.push_back(iSet);
+	    }
+	  }
+	  if (due.empty()) {
+	    continue;
+	  }
+	  try {
+	    samplePass(due, nowNs);
+	  } catch (std::exception & e) {
+	    //e.g. a set's endpoint went away in a reload: the pass cannot even
+	    //be planned.  Record an invalid sample and try again next period.
+	    log (Error(), "UIO: sample pass failed: ", e.what());
+	    for (size_t iDue = 0; iDue < due.size(); iDue++) {
+	      SampleRing & ring = *sampleSets[due[iDue]].ring;
+	      sample.assign(ring.width(), 0);
+	      ring.write(nowNs, sample.data(), false);
+	    }
+	  }
+	  //advance on the original grid, skipping any periods we missed
+	  for (size_t iDue = 0; iDue < due.size(); iDue++) {
+	    sSampleSet & set = sampleSets[due[iDue]];
+	    set.nextNs += set.periodNs;
+	    if (set.nextNs <= nowNs) {
+	      set.nextNs += ((nowNs - set.nextNs)/set.periodNs + 1)*set.periodNs;
+	    }
+	    if (set.callback) {
+	      callbacks.push_back(std::make_pair(set.ring, set.callback));
+	    }
+	  }
+	}
+
+	//the ring holds what this pass wrote, only this thread writes it
+	for (size_t iCallback = 0; iCallback < callbacks.size(); iCallback++) {
+	  SampleRing const & ring = *callbacks[iCallback].first;
+	  sample.resize(ring.width());
+	  uint64_t timeNs = 0;
+	  bool valid = false;
+	  if (!ring.read(ring.latest(), sample.data(), timeNs, valid)) {
+	    continue;
+	  }
+	  try {
+	    callbacks[iCallback].second(timeNs, sample.data(), sample.size(), valid);
+	  } catch (std::exception & e) {
+	    log (Error(), "UIO: sample set callback threw: ", e.what());
+	  } catch (...) {
+	    log (Error(), "UIO: sample set callback threw");
+	  }
+	}
+      } catch (std::exception & e) {
+	log (Error(), "UIO: sampler pass failed: ", e.what());
+      }
+    }
+    close(timerFd);
+  }
+
+  void UIO::samplePass (std::vector<size_t> const & aDue, uint64_t aNowNs) {
+    DeviceFence fence(fenceLock());
+    std::map<std::vector<size_t>,sSamplePass>::iterator itPass = samplePasses.find(aDue);
+    if (itPass == samplePasses.end()) {
+      //first time these sets are due together: read each register once
+      sSamplePass pass;
+      std::vector<uint32_t> addresses;
+      for (size_t iDue = 0; iDue < aDue.size(); iDue++) {
+	std::vector<uint32_t> const & setAddresses = sampleSets[aDue[iDue]].plan->addresses;
+	addresses.insert(addresses.end(), setAddresses.begin(), setAddresses.end());
+      }
+      pass.plan = buildSnapshotPlan(addresses, false);
+      std::vector<uint32_t> const & passAddresses = pass.plan->addresses;
+      pass.setWords.resize(aDue.size());
+      for (size_t iDue = 0; iDue < aDue.size(); iDue++) {
+	std::vector<uint32_t> const & setAddresses = sampleSets[aDue[iDue]].plan->addresses;
+	for (size_t iWord = 0; iWord < setAddresses.size(); iWord++) {
+	  pass.setWords[iDue].push_back(std::lower_bound(passAddresses.begin(), passAddresses.end(),
+							 setAddresses[iWord]) - passAddresses.begin());
+	}
+      }
+      pass.data.resize(passAddresses.size());
+      pass.valid.resize(passAddresses.size());
+      itPass = samplePasses.insert(std::make_pair(aDue, pass)).first;
+    }
+    sSamplePass & pass = itPass->second;
+    sSnapshotPlan const & plan = *pass.plan;
+
+    //one guarded read per map, so a dead endpoint only spoils its own words
+    size_t iBegin = 0;
+    while (iBegin < plan.ranges.size()) {
+      size_t iEnd = iBegin + 1;
+      bool ok = true;
+      try {
+	sUIODevice const * dev = &lookupDevice(plan.ranges[iBegin].uhalAddr);
+	while ((iEnd < plan.ranges.size()) &&
+	       (dev == &lookupDevice(plan.ranges[iEnd].uhalAddr))) {
+	  iEnd++;
+	}
+	copyRanges(plan, iBegin, iEnd, pass.data.data());
+      } catch (uhal::exception::exception & e) {
+	ok = false;
+      }
+      for (size_t iRange = iBegin; iRange < iEnd; iRange++) {
+	size_t offset = plan.ranges[iRange].offset;
+	std::fill(pass.valid.begin() + offset,
+		  pass.valid.begin() + offset + plan.ranges[iRange].size, ok);
+      }
+      iBegin = iEnd;
+    }
+
+    //hand each set its words
+    std::vector<uint32_t> setData;
+    for (size_t iDue = 0; iDue < aDue.size(); iDue++) {
+      sSampleSet & set = sampleSets[aDue[iDue]];
+      std::vector<size_t> const & words = pass.setWords[iDue];
+      setData.resize(words.size());
+      bool valid = true;
+      for (size_t iWord = 0; iWord < words.size(); iWord++) {
+	setData[iWord] = pass.data[words[iWord]];
+	valid = valid && pass.valid[words[iWord]];
+      }
+      set.ring->write(aNowNs, setData.data(), valid);
+    }
+  }
+
+}   // namespace uhal
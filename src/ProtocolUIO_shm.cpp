@@ -0,0 +1,369 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+using namespace uioaxi;
+
+#define UIO_SHM_MAGIC   0x55494F53 // "UIOS"
+#define UIO_SHM_VERSION 1
+
+//addresses start after the header, values after the addresses
+static size_t shmAddressOffset(){
+  return (sizeof(sShmHeader) + 7) & ~size_t(7);
+}
+static size_t shmSize(uint64_t aCount){
+  return shmAddressOffset() + 2*aCount*sizeof(uint32_t);
+}
+
+namespace uioaxi {
+
+  sShmSegment::sShmSegment() :
+    map(NULL),
+    mapSize(0),
+    header(NULL),
+    values(NULL),
+    generation(0),
+    maxAgeNs(0){
+  }
+
+  sShmSegment::~sShmSegment()
+  {
+    if(NULL != map) {
+      munmap(map, mapSize);
+    }
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  size_t UIO::publishRegisters (std::string const & aName, std::vector<std::string> const & aNodes,
+				std::chrono::nanoseconds aPeriod) {
+    size_t set = addSampleSet(aNodes, aPeriod, 1);
+    std::shared_ptr<sSnapshotPlan const> plan = getSamplePlan(set);
+    uint64_t count = plan->addresses.size();
+
+    //readers only need to read: anyone who can write could feed them fake
+    //register values
+    mode_t mode = 0644;
+    char* UIOUHAL_SHM_MODE = getenv("UIOUHAL_SHM_MODE");
+    if (NULL != UIOUHAL_SHM_MODE) {
+      mode = std::strtoul(UIOUHAL_SHM_MODE, 0, 8);
+    }
+    std::string shmName = "/" + aName;
+    int fd = shm_open(shmName.c_str(), O_CREAT|O_RDWR, mode);
+    if (-1 == fd) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to open shared memory ", shmName, ": ", strerror(errno));
+      throw lExc;
+    }
+    //a segment that already exists was created by someone else, maybe with
+    //looser permissions: only take it over if it is ours and can be fixed
+    struct stat shmStat;
+    if (0 != fstat(fd, &shmStat)) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to stat shared memory ", shmName, ": ", strerror(errno));
+      close(fd);
+      throw lExc;
+    }
+    if (shmStat.st_uid != geteuid()) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Shared memory ", shmName, " belongs to uid ", Integer(uint32_t(shmStat.st_uid)),
+	   ", not publishing into it");
+      close(fd);
+      throw lExc;
+    }
+    if (0 != fchmod(fd, mode)) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to set the mode of shared memory ", shmName, ": ", strerror(errno));
+      close(fd);
+      throw lExc;
+    }
+    // never shrink: readers may still map the old size
+    size_t size = shmSize(count);
+    if ((size_t(shmStat.st_size) < size) && (0 != ftruncate(fd, size))) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to size shared memory ", shmName, ": ", strerror(errno));
+      close(fd);
+      throw lExc;
+    }
+    size = std::max(size, size_t(shmStat.st_size));
+    void * map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to map shared memory ", shmName, ": ", strerror(errno));
+      throw lExc;
+    }
+
+    std::unique_ptr<sShmSegment> segment(new sShmSegment);
+    segment->name    = aName;
+    segment->map     = map;
+    segment->mapSize = size;
+    segment->header  = (sShmHeader *) map;
+    uint32_t * addresses = (uint32_t *)((char *) map + shmAddressOffset());
+    segment->values  = (std::atomic<uint32_t> *)(addresses + count);
+
+    //rewrite the layout with the seqlock held so readers fall back to the bus
+    sShmHeader * header = segment->header;
+    uint64_t seq = header->seq.load(std::memory_order_relaxed);
+    seq += (seq & 1) ? 1 : 2; //even, in case a previous publisher died mid-write
+    header->seq.store(seq - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic   = UIO_SHM_MAGIC;
+    header->version = UIO_SHM_VERSION;
+    header->count.store(count, std::memory_order_relaxed);
+    header->valid.store(0, std::memory_order_relaxed);
+    header->timeNs.store(0, std::memory_order_relaxed);
+    std::copy(plan->addresses.begin(), plan->addresses.end(), addresses);
+    header->generation.fetch_add(1, std::memory_order_relaxed);
+    header->seq.store(seq, std::memory_order_release);
+
+    //every sample is copied into the segment from the sampler thread
+    sShmSegment * published = segment.get();
+    {
+      std::lock_guard<std::mutex> lock(samplerMutex);
+      sampleSets[set].callback = [published] (uint64_t aTimeNs, uint32_t const * aData, size_t aSize, bool aValid) {
+	sShmHeader * header = published->header;
+	uint64_t seq = header->seq.load(std::memory_order_relaxed);
+	header->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (size_t i = 0; i < aSize; i++) {
+	  published->values[i].store(aData[i], std::memory_order_relaxed);
+	}
+	header->timeNs.store(aTimeNs, std::memory_order_relaxed);
+	header->valid.store(aValid, std::memory_order_relaxed);
+	header->seq.store(seq + 2, std::memory_order_release);
+      };
+    }
+    {
+      std::lock_guard<std::mutex> lock(shmMutex);
+      shmPublished.push_back(std::move(segment));
+    }
+    log (Debug(), "UIO: publishing ", Integer(uint32_t(count)), " registers in ", shmName);
+    return set;
+  }
+
+  std::unique_ptr<sShmSegment> UIO::mapPublication (std::string const & aName, std::chrono::nanoseconds aMaxAge) {
+    std::string shmName = "/" + aName;
+    int fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+    if (-1 == fd) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to open shared memory ", shmName, ": ", strerror(errno));
+      throw lExc;
+    }
+    struct stat shmStat;
+    if ((0 != fstat(fd, &shmStat)) || (size_t(shmStat.st_size) < sizeof(sShmHeader))) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Shared memory ", shmName, " is not a publication");
+      close(fd);
+      throw lExc;
+    }
+    size_t size = shmStat.st_size;
+    void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Failed to map shared memory ", shmName, ": ", strerror(errno));
+      throw lExc;
+    }
+
+    std::unique_ptr<sShmSegment> segment(new sShmSegment);
+    segment->name     = aName;
+    segment->map      = map;
+    segment->mapSize  = size;
+    segment->header   = (sShmHeader *) map;
+    segment->maxAgeNs = aMaxAge.count();
+    sShmHeader const * header = segment->header;
+    if ((header->magic != UIO_SHM_MAGIC) || (header->version != UIO_SHM_VERSION)) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Shared memory ", shmName, " is not a publication");
+      throw lExc;
+    }
+
+    //take a consistent copy of the layout
+    bool consistent = false;
+    for (int attempt = 0; (attempt < 1000) && !consistent; attempt++) {
+      uint64_t seq = header->seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+	continue;
+      }
+      uint64_t count = header->count.load(std::memory_order_relaxed);
+      if (shmSize(count) > size) {
+	break;
+      }
+      segment->generation = header->generation.load(std::memory_order_relaxed);
+      uint32_t const * addresses = (uint32_t const *)((char const *) map + shmAddressOffset());
+      segment->addresses.assign(addresses, addresses + count);
+      segment->values = (std::atomic<uint32_t> *)(addresses + count);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      consistent = (header->seq.load(std::memory_order_relaxed) == seq);
+    }
+    if (!consistent) {
+      uhal::exception::BadShmSegment lExc;
+      log (lExc, "Could not read the layout of shared memory ", shmName);
+      throw lExc;
+    }
+    log (Debug(), "UIO: attached ", Integer(uint32_t(segment->addresses.size())),
+	 " published registers from ", shmName);
+    return segment;
+  }
+
+  void UIO::attachPublication (std::string const & aName, std::chrono::nanoseconds aMaxAge) {
+    std::shared_ptr<sShmSegment const> segment(mapPublication(aName, aMaxAge));
+    std::lock_guard<std::mutex> lock(shmMutex);
+    std::shared_ptr<ShmSegments const> current = std::atomic_load(&shmAttached);
+    std::shared_ptr<ShmSegments> next = current ? std::make_shared<ShmSegments>(*current) :
+                                                  std::make_shared<ShmSegments>();
+    next->push_back(segment);
+    std::atomic_store(&shmAttached, std::shared_ptr<ShmSegments const>(next));
+    shmReading = true;
+  }
+
+  std::shared_ptr<UIO::ShmSegments const> UIO::remapPublication (std::shared_ptr<sShmSegment const> const & aStale) {
+    std::lock_guard<std::mutex> lock(shmMutex);
+    std::shared_ptr<ShmSegments const> current = std::atomic_load(&shmAttached);
+    size_t iSeg = 0;
+    while ((iSeg < current->size()) && ((*current)[iSeg] != aStale)) {
+      iSeg++;
+    }
+    if (iSeg == current->size()) {
+      //another thread re-mapped it already
+      return current;
+    }
+    std::shared_ptr<sShmSegment const> fresh;
+    try {
+      fresh = mapPublication(aStale->name, std::chrono::nanoseconds(aStale->maxAgeNs));
+    } catch (uhal::exception::BadShmSegment & e) {
+      //mid rewrite, try again on a later read
+      return std::shared_ptr<ShmSegments const>();
+    }
+    std::shared_ptr<ShmSegments> next = std::make_shared<ShmSegments>(*current);
+    (*next)[iSeg] = fresh;
+    std::atomic_store(&shmAttached, std::shared_ptr<ShmSegments const>(next));
+    return next;
+  }
+
+  bool UIO::readPublished (uint32_t aAddr, uint32_t & aValue) {
+    //holding the list keeps its segments mapped while we read them
+    std::shared_ptr<ShmSegments const> segments = std::atomic_load(&shmAttached);
+    bool remapped = false;
+    for (size_t iSeg = 0; segments && (iSeg < segments->size()); iSeg++) {
+      sShmSegment const & segment = *(*segments)[iSeg];
+      std::vector<uint32_t>::const_iterator itAddr = std::lower_bound(segment.addresses.begin(),
+								       segment.addresses.end(),
+								       aAddr);
+      if ((itAddr == segment.addresses.end()) || (*itAddr != aAddr)) {
+	continue;
+      }
+      size_t index = itAddr - segment.addresses.begin();
+      sShmHeader const * header = segment.header;
+
+      //a few tries, then give up and go to the bus
+      bool relayout = false;
+      for (int attempt = 0; (attempt < 4) && !relayout; attempt++) {
+	uint64_t seq = header->seq.load(std::memory_order_acquire);
+	if (seq & 1) {
+	  continue;
+	}
+	uint64_t generation = header->generation.load(std::memory_order_relaxed);
+	uint64_t timeNs     = header->timeNs.load(std::memory_order_relaxed);
+	uint32_t valid      = header->valid.load(std::memory_order_relaxed);
+	uint32_t value      = segment.values[index].load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (header->seq.load(std::memory_order_relaxed) != seq) {
+	  continue;
+	}
+	if (generation != segment.generation) {
+	  relayout = true;
+	  break;
+	}
+	if (!valid) {
+	  return false;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t nowNs = uint64_t(now.tv_sec)*1000000000ULL + now.tv_nsec;
+	if (nowNs - timeNs > segment.maxAgeNs) {
+	  //too stale
+	  return false;
+	}
+	aValue = value;
+	return true;
+      }
+      if (!relayout) {
+	return false;
+      }
+      //the publisher rewrote the layout (e.g. it restarted): map it again,
+      //at most once per read, and look the address up in the new layout.
+      //Segments are only ever replaced, so iSeg still names it.
+      if (remapped) {
+	return false;
+      }
+      remapped = true;
+      segments = remapPublication((*segments)[iSeg]);
+      iSeg--;
+    }
+    return false;
+  }
+
+}   // namespace uhal
@@ -0,0 +1,129 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <signal.h>
+#include <setjmp.h> //for BUS_ERROR signal handling
+#include <pthread.h>
+#include <mutex>
+
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+// Unlike uhal::SigBusGuard, which serializes every guarded access in the
+// process behind one lock and one jump buffer, this guard keeps its state per
+// thread so that accesses to different endpoints can stall in parallel.
+// The handler is installed once and stays installed.
+
+static thread_local sigjmp_buf threadEnv;
+static thread_local volatile sig_atomic_t threadProtected = 0;
+static thread_local bool threadUnblocked = false;
+static struct sigaction previousAction;
+static std::once_flag handlerInstalled;
+
+static void handleSigBus(int aSignal, siginfo_t * aInfo, void * aContext){
+  if (threadProtected) {
+    threadProtected = 0;
+    siglongjmp(threadEnv, 1);
+  }
+  // not a guarded access: hand the signal to whoever had it before us
+  if (previousAction.sa_flags & SA_SIGINFO) {
+    if (NULL != previousAction.sa_sigaction) {
+      previousAction.sa_sigaction(aSignal, aInfo, aContext);
+      return;
+    }
+  } else if ((SIG_DFL != previousAction.sa_handler) && (SIG_IGN != previousAction.sa_handler)) {
+    previousAction.sa_handler(aSignal);
+    return;
+  }
+  // default action: the faulting access is retried and kills the process
+  signal(SIGBUS, SIG_DFL);
+}
+
+static void unblockSigBus(){
+  sigset_t busSet;
+  sigemptyset(&busSet);
+  sigaddset(&busSet, SIGBUS);
+  pthread_sigmask(SIG_UNBLOCK, &busSet, NULL);
+}
+
+static void installHandler(){
+  struct sigaction action;
+  action.sa_sigaction = handleSigBus;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, &previousAction);
+}
+
+namespace uioaxi {
+
+  void ThreadBusGuard::protect(std::function<void()> const & aAccess, char const * aMessage){
+    std::call_once(handlerInstalled, installHandler);
+
+    // uhal::SigBusGuard::blockSIGBUS() blocks SIGBUS everywhere; let it
+    // through in this thread.  It stays unblocked, so later accesses make no
+    // system call: a bus error is synchronous, and outside a guarded access
+    // the handler passes it on just as if it had been blocked.
+    if (!threadUnblocked) {
+      unblockSigBus();
+      threadUnblocked = true;
+    }
+
+    threadProtected = 0; //first touch of the TLS happens outside the handler
+    if (0 == sigsetjmp(threadEnv, 0)) {
+      threadProtected = 1;
+      aAccess();
+      threadProtected = 0;
+      return;
+    }
+    // the handler ran with SIGBUS blocked and siglongjmp did not restore the mask
+    unblockSigBus();
+    uhal::exception::SigBusError lExc;
+    uhal::log (lExc, "SIGBUS received during ", aMessage);
+    throw lExc;
+  }
+
+}//uioaxi namespace
@@ -0,0 +1,237 @@
+/*
+---------------------------------------------------------------------------
+
+    This is an extension of uHAL to directly access AXI slaves via the linux
+    UIO driver. 
+
+    This file is part of uHAL.
+
+    uHAL is a hardware access library and programming framework
+    originally developed for upgrades of the Level-1 trigger of the CMS
+    experiment at CERN.
+
+    uHAL is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    uHAL is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with uHAL.  If not, see <http://www.gnu.org/licenses/>.
+
+
+      Andrew Rose, Imperial College, London
+      email: awr01 <AT> imperial.ac.uk
+
+      Marc Magrans de Abril, CERN
+      email: marc.magrans.de.abril <AT> cern.ch
+
+      Tom Williams, Rutherford Appleton Laboratory, Oxfordshire
+      email: tom.williams <AT> cern.ch
+
+      Dan Gastler, Boston University 
+      email: dgastler <AT> bu.edu
+      
+---------------------------------------------------------------------------
+*/
+/**
+	@file
+	@author Siqi Yuan / Dan Gastler / Theron Jasper Tarigo
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include <uhal/Node.hpp>
+#include <uhal/log/LogLevels.hpp>
+#include <uhal/log/log_inserters.integer.hpp>
+#include <uhal/log/log.hpp>
+
+#include <ProtocolUIO.hpp>
+
+#include <inttypes.h> //for PRI macros
+
+using namespace uioaxi;
+
+//Four words compared at a time; gcc lowers this to SSE2/NEON
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+
+namespace uioaxi {
+
+  void diffSnapshot(sSnapshot const & aPrevious, sSnapshot const & aCurrent,
+		    std::vector<sSnapshotChange> & aChanges) {
+    if ((aPrevious.plan != aCurrent.plan) ||
+	(aPrevious.data.size() != aCurrent.data.size())) {
+      uhal::exception::SnapshotMismatch lExc;
+      uhal::log (lExc, "Snapshots were not taken with the same plan");
+      throw lExc;
+    }
+    sSnapshotPlan const & plan = *aCurrent.plan;
+    uint32_t const * prev = aPrevious.data.data();
+    uint32_t const * cur  = aCurrent.data.data();
+    size_t nWords = aCurrent.data.size();
+
+    size_t iWord = 0;
+    for (; iWord + 4 <= nWords; iWord += 4) {
+      v4u32 a, b;
+      memcpy(&a, prev + iWord, sizeof(a));
+      memcpy(&b, cur  + iWord, sizeof(b));
+      v4u32 diff = a ^ b;
+      uint64_t folded[2];
+      memcpy(folded, &diff, sizeof(folded));
+      if (0 == (folded[0] | folded[1])) {
+	//nothing changed in these four words
+	continue;
+      }
+      for (size_t i = iWord; i < iWord + 4; i++) {
+	if (prev[i] != cur[i]) {
+	  sSnapshotChange change = {plan.addresses[i], prev[i], cur[i], &plan.paths[i]};
+	  aChanges.push_back(change);
+	}
+      }
+    }
+    for (; iWord < nWords; iWord++) {
+      if (prev[iWord] != cur[iWord]) {
+	sSnapshotChange change = {plan.addresses[iWord], prev[iWord], cur[iWord], &plan.paths[iWord]};
+	aChanges.push_back(change);
+      }
+    }
+  }
+
+}//uioaxi namespace
+
+namespace uhal {  
+
+  std::string const & UIO::pathOfAddress (uint32_t aAddr) {
+    if (addressPaths.empty()) {
+      //Index the address table once. Nodes are visited parents first, so an
+      //address maps to its register rather than one of its bit fields.
+      size_t rootLength = addressTable->getId().size() + 1;
+      for (Node::const_iterator itNode = addressTable->begin(); itNode != addressTable->end(); itNode++) {
+	if (itNode->getMode() == defs::HIERARCHICAL) {
+	  continue;
+	}
+	std::string path = itNode->getPath();
+	path = (path.size() > rootLength) ? path.substr(rootLength) : path;
+	uint32_t size = (itNode->getMode() == defs::INCREMENTAL) ? itNode->getSize() : 1;
+	for (uint32_t i = 0; i < size; i++) {
+	  addressPaths.insert(std::make_pair(itNode->getAddress() + i, path));
+	}
+      }
+    }
+    static std::string const unknown;
+    std::map<uint32_t,std::string>::const_iterator itPath = addressPaths.find(aAddr);
+    return (itPath == addressPaths.end()) ? unknown : itPath->second;
+  }
+
+  std::shared_ptr<sSnapshotPlan const> UIO::buildSnapshotPlan (std::vector<uint32_t> & aAddresses,
+							      bool aWithPaths) {
+    DeviceFence fence(fenceLock());
+    std::sort(aAddresses.begin(), aAddresses.end());
+    aAddresses.erase(std::unique(aAddresses.begin(), aAddresses.end()), aAddresses.end());
+
+    std::shared_ptr<sSnapshotPlan> plan = std::make_shared<sSnapshotPlan>();
+    plan->addresses = aAddresses;
+    if (aWithPaths) {
+      plan->paths.reserve(aAddresses.size());
+    }
+
+    //merge consecutive addresses of the same map into ranges
+    sUIODevice const * lastDev = NULL;
+    for (size_t iWord = 0; iWord < aAddresses.size(); iWord++) {
+      uint32_t addr = aAddresses[iWord];
+      sUIODevice const * dev = &lookupDevice(addr);
+      if (plan->ranges.empty() || (dev != lastDev) ||
+	  (plan->ranges.back().uhalAddr + plan->ranges.back().size != addr)) {
+	sSnapshotRange range = {addr, 0, iWord};
+	plan->ranges.push_back(range);
+      }
+      plan->ranges.back().size++;
+      if (aWithPaths) {
+	plan->paths.push_back(pathOfAddress(addr));
+      }
+      lastDev = dev;
+    }
+    log ( Debug(), "UIO: snapshot plan with ", Integer(uint32_t(aAddresses.size())),
+	  " words in ", Integer(uint32_t(plan->ranges.size())), " ranges");
+    return plan;
+  }
+
+  std::shared_ptr<sSnapshotPlan const> UIO::compileSnapshot (std::vector<std::string> const & aNodes) {
+    std::vector<uint32_t> addresses;
+    for (size_t iNode = 0; iNode < aNodes.size(); iNode++) {
+      Node const & node = addressTable->getNode(aNodes[iNode]);
+      //the node itself and everything below it
+      for (Node::const_iterator itNode = node.begin(); itNode != node.end(); itNode++) {
+	//reading a port (FIFO) consumes data, a snapshot must not do that
+	if ((itNode->getMode() == defs::HIERARCHICAL) ||
+	    (itNode->getMode() == defs::NON_INCREMENTAL) ||
+	    !(itNode->getPermission() & defs::READ)) {
+	  continue;
+	}
+	uint32_t size = (itNode->getMode() == defs::INCREMENTAL) ? itNode->getSize() : 1;
+	for (uint32_t i = 0; i < size; i++) {
+	  addresses.push_back(itNode->getAddress() + i);
+	}
+      }
+    }
+    return buildSnapshotPlan(addresses);
+  }
+
+  std::shared_ptr<sSnapshotPlan const> UIO::compileSnapshot (std::vector<std::pair<uint32_t,uint32_t> > const & aRanges) {
+    std::vector<uint32_t> addresses;
+    for (size_t iRange = 0; iRange < aRanges.size(); iRange++) {
+      for (uint32_t i = 0; i < aRanges[iRange].second; i++) {
+	addresses.push_back(aRanges[iRange].first + i);
+      }
+    }
+    return buildSnapshotPlan(addresses);
+  }
+
+  void UIO::copyRanges (sSnapshotPlan const & aPlan, size_t aBegin, size_t aEnd, uint32_t * aData) {
+    DeviceFence fence(fenceLock());
+    //one guarded copy per map, so bus errors count against the right endpoint
+    size_t iBegin = aBegin;
+    while (iBegin < aEnd) {
+      sUIODevice const & dev = lookupDevice(aPlan.ranges[iBegin].uhalAddr, aPlan.ranges[iBegin].size);
+      size_t iEnd = iBegin + 1;
+      while ((iEnd < aEnd) &&
+	     (&dev == &lookupDevice(aPlan.ranges[iEnd].uhalAddr, aPlan.ranges[iEnd].size))) {
+	iEnd++;
+      }
+
+      char error_message[] = "Snapshot: 0x00000000 - 0x00000000";
+      snprintf(error_message, strlen(error_message)+1, "Snapshot: 0x%08X - 0x%08X",
+	       aPlan.ranges[iBegin].uhalAddr,
+	       aPlan.ranges[iEnd-1].uhalAddr + aPlan.ranges[iEnd-1].size - 1);
+      protectAccess(dev, [&] {
+	  for (size_t iRange = iBegin; iRange < iEnd; iRange++) {
+	    sSnapshotRange const & range = aPlan.ranges[iRange];
+	    uint32_t volatile const * src = dev.hw + (range.uhalAddr - dev.uhalAddr);
+	    uint32_t * dst = aData + range.offset;
+	    for (uint32_t i = 0; i < range.size; i++) {
+	      dst[i] = src[i];
+	    }
+	  }
+	}, error_message);
+      iBegin = iEnd;
+    }
+  }
+
+  void UIO::takeSnapshot (sSnapshot & aSnapshot) {
+    DeviceFence fence(fenceLock());
+    //held back bit-field writes must show up in the snapshot
+    flushRMW();
+    sSnapshotPlan const & plan = *aSnapshot.plan;
+    aSnapshot.data.resize(plan.addresses.size());
+    copyRanges(plan, 0, plan.ranges.size(), aSnapshot.data.data());
+    aSnapshot.sequence++;
+  }
+
+}   // namespace uhal
@@ -0,0 +1,48 @@
+/*
+  Shared by the tests: counts every C++ allocation in the process, reports
+  PASS/FAIL lines and reads the thread's minor page faults.  Each test is one
+  translation unit, so the replaced operator new/delete live here.
+*/
+
+#ifndef __UIO_TEST_FIXTURE_HH__
+#define __UIO_TEST_FIXTURE_HH__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <new>
+
+//count every C++ allocation in the process
+static std::atomic<size_t> allocations(0);
+
+void * operator new(size_t aSize) {
+  allocations++;
+  void * ptr = malloc(aSize);
+  if (NULL == ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+//out of line, so the compiler does not pair the free() with a new expression
+__attribute__((noinline)) void operator delete(void * aPtr) noexcept {
+  free(aPtr);
+}
+
+static int failures = 0;
+
+static void check(bool aOk, char const * aWhat) {
+  printf("%s: %s\n", aOk ? "PASS" : "FAIL", aWhat);
+  if (!aOk) {
+    failures++;
+  }
+}
+
+inline long minorFaults() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_minflt;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+  Test access to uhal::UIO: builds a client whose endpoints are backed by
+  memory the test maps itself (anonymous or file mappings) instead of UIO
+  devices, so the tests run the client's real access and dispatch paths
+  without hardware, an address table or /sys/class/uio.
+*/
+
+#ifndef __UIO_TEST_HOOK_HH__
+#define __UIO_TEST_HOOK_HH__
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <memory>
+#include <string>
+
+#include <ProtocolUIO.hpp>
+
+namespace uioaxi {
+
+  class UIOTestHook{
+  public:
+    //A client with no endpoints, ignoring UIOUHAL_* settings other than the
+    //health ones read by every client
+    static std::unique_ptr<uhal::UIO> makeClient(){
+      std::unique_ptr<uhal::UIO> client(new uhal::UIO("test", uhal::URI(),
+						       boost::posix_time::milliseconds(10),
+						       sNoDiscovery()));
+      client->realtime = false;
+      client->threadGuard = false;
+      return client;
+    }
+
+    //Anonymous shared memory, populated like a real-time map
+    static void * anonymousMap(size_t aBytes){
+      void * map = mmap(NULL, aBytes, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+      return (MAP_FAILED == map) ? NULL : map;
+    }
+
+    //Place aMap (aBytes long) at aUhalAddr as endpoint aName.  The client
+    //owns the mapping from now on and unmaps it when it goes away.
+    static void addMap(uhal::UIO & aClient, std::string const & aName, uint32_t aUhalAddr,
+		       void * aMap, size_t aBytes){
+      sUIODevice & dev = aClient.devices[aUhalAddr];
+      dev.file       = std::make_shared<sUIOFile>(-1);
+      dev.hw         = (uint32_t volatile *) aMap;
+      dev.uhalAddr   = aUhalAddr;
+      dev.size       = aBytes/sizeof(uint32_t);
+      dev.mapBytes   = aBytes;
+      dev.uioName    = "test_" + aName;
+      dev.hwNodeName = aName;
+      dev.health     = std::make_shared<sEndpointHealth>(aName);
+      dev.busDomain  = aClient.busDomainIndex(aName);
+      aClient.endpointHealth.push_back(dev.health);
+    }
+
+    //What UIOUHAL_REALTIME sets up once the endpoints are mapped
+    static void realtime(uhal::UIO & aClient){
+      aClient.realtime = true;
+      aClient.threadGuard = true;
+      aClient.setupRealtime();
+    }
+
+    //Take the device lock on every access, as UIOUHAL_HOT_RELOAD does
+    static void fenceAccesses(uhal::UIO & aClient){
+      aClient.hotReload = true;
+    }
+
+    //What UIOUHAL_ASYNC_DISPATCH sets up
+    static void asyncDispatch(uhal::UIO & aClient, size_t aQueueDepth){
+      aClient.startAsyncDispatch(aQueueDepth);
+    }
+
+    //Queued or held back transactions not yet executed
+    static size_t pending(uhal::UIO & aClient){
+      return aClient.rmwBatch.transactions.size() +
+	(aClient.pendingBatch ? aClient.pendingBatch->transactions.size() : 0);
+    }
+  };
+
+}
+
+#endif
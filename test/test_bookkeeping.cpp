@@ -0,0 +1,89 @@
+/*
+  Checks that the per-dispatch bookkeeping stops allocating once it has warmed
+  up, through the client's real asynchronous dispatch path: uHAL write(),
+  read() and rmw_bits() queue into the pending batch, dispatch() hands it to
+  the async worker (submitBatch), and the worker runs it (executeBatch) and
+  recycles it.
+
+  The client is built by UIOTestHook over two anonymous mappings in different
+  bus domains, so batches are also split into partitions.  Built and run by
+  "make test".
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "TestFixture.hpp"
+#include "UIOTestHook.hpp"
+
+using namespace uioaxi;
+
+static uint32_t const baseA = 0x1000;
+static uint32_t const baseB = 0x2000;
+static size_t const count = 64;
+
+//aCount dispatches of up to 64 registers each, waiting for every one
+static bool dispatches(uhal::UIO & aClient, int aCount) {
+  bool ok = true;
+  for (int i = 0; i < aCount; i++) {
+    size_t registers = 1 + (i * 7) % count;
+    std::vector<uhal::ValWord<uint32_t> > reads;
+    reads.reserve(registers);
+    for (size_t reg = 0; reg < registers; reg++) {
+      uint32_t addr = ((reg & 1) ? baseB : baseA) + uint32_t(reg);
+      aClient.write(addr, uint32_t(i));
+      aClient.rmw_bits(addr, 0xFFFF0000, 0x00000001);
+      reads.push_back(aClient.read(addr));
+    }
+    aClient.dispatch();
+    aClient.getDispatchFuture().get();
+    for (size_t reg = 0; reg < reads.size(); reg++) {
+      ok = ok && reads[reg].valid() && (reads[reg].value() == ((uint32_t(i) & 0xFFFF0000) | 1));
+    }
+  }
+  return ok;
+}
+
+int main() {
+  std::unique_ptr<uhal::UIO> client = UIOTestHook::makeClient();
+  size_t const bytes = count*sizeof(uint32_t);
+  void * mapA = UIOTestHook::anonymousMap(bytes);
+  void * mapB = UIOTestHook::anonymousMap(bytes);
+  if ((NULL == mapA) || (NULL == mapB)) {
+    perror("mmap");
+    return 1;
+  }
+  UIOTestHook::addMap(*client, "A", baseA, mapA, bytes);
+  UIOTestHook::addMap(*client, "B", baseB, mapB, bytes);
+  UIOTestHook::asyncDispatch(*client, 4);
+
+  //warm up: every batch in circulation reaches the largest size
+  bool ok = dispatches(*client, 1000);
+  sBookkeepingStats warm = client->getBookkeepingStats();
+
+  //the same dispatches twice: only uHAL's ValWord/ValHeader may allocate,
+  //and they do the same each time
+  size_t allocatedBefore = allocations;
+  ok = dispatches(*client, 1000) && ok;
+  size_t allocatedFirst = allocations - allocatedBefore;
+  allocatedBefore = allocations;
+  ok = dispatches(*client, 1000) && ok;
+  size_t allocatedSecond = allocations - allocatedBefore;
+  sBookkeepingStats steady = client->getBookkeepingStats();
+
+  uint64_t counted = steady.allocations - warm.allocations;
+  uint64_t operations = steady.operations - warm.operations;
+  printf("warm up: %llu allocations in %llu operations\n",
+	 (unsigned long long) warm.allocations, (unsigned long long) warm.operations);
+  printf("steady state: %.6f allocations per operation over %llu operations\n",
+	 double(counted) / double(operations), (unsigned long long) operations);
+  check(ok, "dispatched reads return what was written");
+  check(0 != warm.allocations, "warm up allocations are counted");
+  check(0 == counted, "allocations stop growing after warm up");
+  check(allocatedFirst == allocatedSecond, "steady state allocates nothing beyond uHAL's values");
+
+  client.reset();
+  return (0 == failures) ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+  Checks real-time mode (UIOUHAL_REALTIME): once a thread has done its first
+  access, UIO::readRegister and UIO::writeRegister must not allocate, page
+  fault or make system calls, with or without the device lock of hot reload,
+  and a bus error must still come back as uhal::exception::SigBusError.
+
+  The client is built by UIOTestHook over an anonymous mapping standing in for
+  a UIO map.  Built and run by "make test".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/seccomp.h>
+#include <string>
+
+#include "TestFixture.hpp"
+#include "UIOTestHook.hpp"
+
+using namespace uioaxi;
+
+//writes, reads and read-modify-writes of every register through the client
+static bool accessLoop(uhal::UIO & aClient, uint32_t aBase, size_t aCount, int aPasses) {
+  bool ok = true;
+  for (int pass = 0; pass < aPasses; pass++) {
+    for (size_t i = 0; i < aCount; i++) {
+      uint32_t addr = aBase + uint32_t(i);
+      uint32_t value = uint32_t(i + pass);
+      aClient.writeRegister(addr, value);
+      uint32_t readval = aClient.readRegister(addr);
+      aClient.writeRegister(addr, readval | 0x80000000);
+      ok = ok && (aClient.readRegister(addr) == (value | 0x80000000));
+    }
+  }
+  return ok;
+}
+
+//the steady state checks, on whatever the client does per access
+static void steadyState(uhal::UIO & aClient, uint32_t aBase, size_t aCount, char const * aMode) {
+  std::string mode(aMode);
+  //warm up: installs the handler and unblocks SIGBUS in this thread
+  check(accessLoop(aClient, aBase, aCount, 1), (mode + ": accesses read back what was written").c_str());
+
+  size_t allocationsBefore = allocations;
+  long faultsBefore = minorFaults();
+  bool ok = accessLoop(aClient, aBase, aCount, 100);
+  long faults = minorFaults() - faultsBefore;
+  size_t allocated = allocations - allocationsBefore;
+  check(ok, (mode + ": steady state accesses are correct").c_str());
+  check(0 == allocated, (mode + ": steady state accesses do not allocate").c_str());
+  check(0 == faults, (mode + ": steady state accesses do not page fault").c_str());
+
+  //in strict seccomp mode any system call but read/write/exit/sigreturn kills the child
+  pid_t child = fork();
+  if (0 == child) {
+    if (0 != prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT)) {
+      _exit(2);
+    }
+    bool childOk = accessLoop(aClient, aBase, aCount, 10);
+    syscall(SYS_exit, childOk ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  check(WIFEXITED(status) && (0 == WEXITSTATUS(status)),
+	(mode + ": steady state accesses make no system calls").c_str());
+}
+
+int main() {
+  std::unique_ptr<uhal::UIO> client = UIOTestHook::makeClient();
+
+  //stand-in for a UIO map: populated and locked like openDevice does in real-time mode
+  uint32_t const base = 0x1000;
+  size_t const count = 4096;
+  size_t const bytes = count*sizeof(uint32_t);
+  void * map = UIOTestHook::anonymousMap(bytes);
+  if (NULL == map) {
+    perror("mmap");
+    return 1;
+  }
+  if (0 != mlock(map, bytes)) {
+    perror("mlock (continuing, page fault counts may be off)");
+  }
+  UIOTestHook::addMap(*client, "REGS", base, map, bytes);
+
+  //past the end of a file-backed mapping the access raises SIGBUS
+  char path[] = "/tmp/uiouhal_test_XXXXXX";
+  int fd = mkstemp(path);
+  unlink(path);
+  long page = sysconf(_SC_PAGESIZE);
+  if ((-1 == fd) || (0 != ftruncate(fd, page))) {
+    perror("mkstemp");
+    return 1;
+  }
+  void * file = mmap(NULL, 2*page, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == file) {
+    perror("mmap");
+    return 1;
+  }
+  uint32_t const deadBase = 0x100000;
+  UIOTestHook::addMap(*client, "DEAD", deadBase, file, 2*page);
+
+  UIOTestHook::realtime(*client);
+  steadyState(*client, base, count, "real-time");
+  UIOTestHook::fenceAccesses(*client);
+  steadyState(*client, base, count, "real-time with hot reload lock");
+
+  uint32_t const dead = deadBase + uint32_t(page/sizeof(uint32_t));
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool thrown = false;
+    try {
+      client->readRegister(dead);
+    } catch (uhal::exception::SigBusError & e) {
+      thrown = true;
+    }
+    check(thrown, (0 == attempt) ? "bus error is thrown" : "bus error after a bus error is thrown");
+  }
+  check(accessLoop(*client, base, count, 1), "accesses work after a bus error");
+
+  client.reset();
+  return (0 == failures) ? 0 : 1;
+}